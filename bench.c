@@ -0,0 +1,537 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Benchmark of the engine: every level of the set and a few made up
+ * worst cases are played for a number of ticks with the same keys, a
+ * few times over, on one thread (the big made up ones for fewer ticks,
+ * they take long enough). Printed for every one are the times of
+ * loading and restarting the level, of a tick, of the phases of a tick
+ * (CrashRemove, MoveRocks, MoveBoxes), of FindObject and of composing
+ * the view into memory, the medians of the runs, and the checksum of
+ * the world at the end. The checksums can be written to a file and
+ * checked against it later, a change which makes the game play
+ * differently shows there.
+ *
+ * A run is played twice: once with nothing but the keys and the ticks
+ * timed, once with the phases timed and the view composed after every
+ * move of the objects. The two must end the same.
+ */
+
+#include "world.h"
+#include "render.h"
+#include "pack.h"
+#include <getopt.h>
+#include <stddef.h>
+
+#define BENCH_TICKS         (60 * (INTER_TIME + 1)) // A minute of the game
+#define BENCH_RUNS          5
+#define BENCH_EVERY         (INTER_TIME / 10) // Ticks between keys
+#define BENCH_LOAD_CELLS    (1 << 20) // Cells loaded a run, at least a level
+#define BENCH_FINDS         10000
+
+enum synthetic {SYN_ROCKS,  // The upper half full of rocks, all falling
+                SYN_FLIES,  // Flies and boxes everywhere
+                SYN_MIXED}; // Bands of rocks falling on flies and boxes
+
+struct synthetic_level
+{
+    const char *name;
+    int kind;
+    int width, height;
+    int seconds;          // Played for at most, 0 for the ticks asked
+};
+
+const struct synthetic_level SyntheticLevels[] =
+{
+    {"rocks",      SYN_ROCKS, 40,  22,   0},
+    {"rocks-tall", SYN_ROCKS, 64,  1024, 10},
+    {"flies",      SYN_FLIES, 40,  22,   0},
+    {"flies-big",  SYN_FLIES, 256, 256,  10},
+    {"mixed-big",  SYN_MIXED, 512, 512,  10},
+};
+
+#define SYNTHETIC_LEVELS    ((int)(sizeof(SyntheticLevels) / sizeof(SyntheticLevels[0])))
+
+/*
+ * Times of a run, nanoseconds
+ */
+struct sample
+{
+    double load;          // LoadLevel of a level not loaded before
+    double restart;       // LoadLevel of the level loaded last
+    double tick;          // world_step() and the keys
+    double phase[PHASES]; // A tick, of every phase
+    double find;          // FindObject() of the player
+    double view;          // A frame composed into memory
+};
+
+/*
+ * A line of a golden file: the checksum of a level played for the
+ * ticks with the seed
+ */
+struct golden
+{
+    char name[32];
+    unsigned long ticks;
+    unsigned long long seed;
+    uint64_t checksum;
+};
+
+/********************
+ * Global variables *
+ ********************/
+struct level *Levels;
+int LevelsCount;
+int Kernel = KERNEL_AUTO;
+unsigned long Ticks = BENCH_TICKS;
+int Runs = BENCH_RUNS;
+unsigned long long Seed = WORLD_SEED;
+char *Only;               // Name of the one to run
+char *CheckPath;          // Golden checksums to check against
+char *WritePath;          // Golden checksums to write
+struct golden *Golden;
+int GoldenCount;
+struct renderer View;     // The view, composed into memory
+volatile int Sink;        // Results nobody needs, kept from the optimizer
+
+
+uint64_t Clock(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/****************************************************************
+ * Cells of a made up level, '0' + tile; the player sits walled *
+ * in a corner out of harm's way                                *
+ ****************************************************************/
+char *SyntheticCells(const struct synthetic_level *s)
+{
+    char *cells = malloc((size_t)s->width * s->height);
+    int j, i, t;
+
+    if (cells == NULL)
+        return NULL;
+    for (j = 0; j < s->height; j++)
+        for (i = 0; i < s->width; i++)
+        {
+            switch (s->kind)
+            {
+                case SYN_ROCKS:
+                    t = j < s->height / 2 ? ROCK : TUNNEL;
+                    break;
+                case SYN_FLIES:
+                    t = j % 4 == 2 && i % 4 == 2
+                        ? ((j / 4 + i / 4) % 2 ? FLY : BOX) : TUNNEL;
+                    break;
+                default:
+                    t = j % 8 < 3 ? ROCK
+                        : j % 8 == 6 && i % 3 == 1 ? (i % 2 ? FLY : BOX)
+                        : TUNNEL;
+            }
+            if (j == 0 || i == 0 || j == s->height - 1 || i == s->width - 1
+                || (j >= s->height - 3 && i >= s->width - 3))
+                t = METAL;
+            if (j == s->height - 2 && i == s->width - 2)
+                t = HERO;
+            cells[(size_t)j * s->width + i] = '0' + t;
+        }
+    return cells;
+}
+
+
+/**********************************************************
+ * The levels of the set and the made up ones after them, *
+ * NULL when there is no memory                           *
+ **********************************************************/
+struct level *BenchLevels(void)
+{
+    struct level *l = calloc(LevelsCount + SYNTHETIC_LEVELS, sizeof(struct level));
+    const struct synthetic_level *s;
+    int k;
+
+    if (l == NULL)
+        return NULL;
+    memcpy(l, Levels, LevelsCount * sizeof(struct level));
+    for (k = 0; k < SYNTHETIC_LEVELS; k++)
+    {
+        s = &SyntheticLevels[k];
+        l[LevelsCount + k].width = s->width;
+        l[LevelsCount + k].height = s->height;
+        l[LevelsCount + k].diamonds = 1; // Never done, there are none
+        l[LevelsCount + k].time = 999;
+        l[LevelsCount + k].stride = s->width;
+        l[LevelsCount + k].cells = SyntheticCells(s);
+        if (l[LevelsCount + k].cells == NULL)
+            return NULL;
+    }
+    return l;
+}
+
+
+/*********************************************************
+ * A new world on the level, as the game starts it; NULL *
+ * when the level doesn't fit in memory                  *
+ *********************************************************/
+struct world *BenchWorld(struct level *l, int count, int level)
+{
+    struct world *w = world_create_levels(l, count, level);
+
+    if (w == NULL)
+        return NULL;
+    if (w->game.current_level != level)
+    {
+        world_destroy(w); // Started over from the first level instead
+        return NULL;
+    }
+    w->kernel = KernelSupported(Kernel);
+    world_seed(w, Seed);
+    return w;
+}
+
+
+/******************************************************************
+ * Play the ticks: the player walks one way and turns at random,  *
+ * starts again when killed and stays on the level when it's done *
+ ******************************************************************/
+void Play(struct world *w, int level, unsigned long ticks, struct sample *s)
+{
+    uint64_t random = Seed, z, t;
+    unsigned long tick, frames = 0;
+    int way = 0;
+
+    for (tick = 0; tick < ticks; tick++)
+    {
+        if (tick % BENCH_EVERY == 0)
+        {
+            z = (random += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            if ((z >> 40) % 4 == 0)
+                way = (z >> 20) % 4;
+            world_key(w, w->game.hero_state == KILLED ? ' ' : "wasd"[way]);
+        }
+        if ((world_step(w) & WORLD_LEVEL_DONE))
+            StartLevel(w, level);
+
+        if (s != NULL && w->phase_ns != NULL && w->refresh_timer == INTER_TIME / 5)
+        {
+            // Objects have just moved
+            t = Clock();
+            render_view(&View, w);
+            render_flush(&View);
+            s->view += Clock() - t;
+            frames++;
+        }
+    }
+    if (s != NULL && frames)
+        s->view /= frames;
+}
+
+
+/*********************************************************************
+ * Time a run of the level, returns the checksum of the world at the *
+ * end, 0 when it can't be run or the two plays of it differ         *
+ *********************************************************************/
+uint64_t Run(struct level *l, int count, int level, unsigned long ticks,
+             struct sample *s)
+{
+    struct world *w;
+    uint64_t phase_ns[PHASES], checksum, t;
+    int k, loads, y, x;
+
+    memset(s, 0, sizeof(*s));
+    w = BenchWorld(l, count, level);
+    if (w == NULL)
+        return 0;
+
+    // The cold loads, then the restarts from the copy
+    loads = BENCH_LOAD_CELLS / ((long long)l[level].width * l[level].height) + 1;
+    t = Clock();
+    for (k = 0; k < loads; k++)
+    {
+        w->start.level = -1;
+        LoadLevel(w, level);
+    }
+    s->load = (double)(Clock() - t) / loads;
+    t = Clock();
+    for (k = 0; k < loads; k++)
+        LoadLevel(w, level);
+    s->restart = (double)(Clock() - t) / loads;
+    world_destroy(w);
+
+    // The ticks alone
+    w = BenchWorld(l, count, level);
+    if (w == NULL)
+        return 0;
+    t = Clock();
+    Play(w, level, ticks, NULL);
+    s->tick = (double)(Clock() - t) / ticks;
+    checksum = world_checksum(w);
+    world_destroy(w);
+
+    // The parts of them
+    w = BenchWorld(l, count, level);
+    if (w == NULL)
+        return 0;
+    t = Clock();
+    for (k = 0; k < BENCH_FINDS; k++)
+        Sink += FindObject(w, HERO, &y, &x) + y + x;
+    s->find = (double)(Clock() - t) / BENCH_FINDS;
+
+    memset(phase_ns, 0, sizeof(phase_ns));
+    w->phase_ns = phase_ns;
+    View.full = 1;
+    Play(w, level, ticks, s);
+    for (k = 0; k < PHASES; k++)
+        s->phase[k] = (double)phase_ns[k] / ticks;
+    if (world_checksum(w) != checksum)
+        checksum = 0; // The timed run played differently
+    world_destroy(w);
+    return checksum;
+}
+
+
+int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/**************************************************
+ * Median of the field at "offset" of the samples *
+ **************************************************/
+double Median(struct sample *s, int n, size_t offset, double *low, double *high)
+{
+    double v[n];
+    int k;
+
+    for (k = 0; k < n; k++)
+        v[k] = *(double*)((char*)&s[k] + offset);
+    qsort(v, n, sizeof(double), CompareDoubles);
+    if (low != NULL)
+        *low = v[0];
+    if (high != NULL)
+        *high = v[n - 1];
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+/********************************************************
+ * Read the golden checksums, -1 when they can't be had *
+ ********************************************************/
+int ReadGolden(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    struct golden g, *grown;
+    unsigned long long v;
+
+    if (f == NULL)
+        return -1;
+    while (fscanf(f, "%31s %lu %llu %llx", g.name, &g.ticks, &g.seed, &v) == 4)
+    {
+        grown = realloc(Golden, (GoldenCount + 1) * sizeof(struct golden));
+        if (grown == NULL)
+            break;
+        Golden = grown;
+        g.checksum = v;
+        Golden[GoldenCount++] = g;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/**************************************************
+ * The golden checksum of the name played for the *
+ * ticks with the seed, 0 when there is none      *
+ **************************************************/
+uint64_t GoldenOf(const char *name, unsigned long ticks)
+{
+    int k;
+
+    for (k = 0; k < GoldenCount; k++)
+        if (!strcmp(Golden[k].name, name) && Golden[k].ticks == ticks
+            && Golden[k].seed == Seed)
+            return Golden[k].checksum;
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct level *l;
+    struct sample *s;
+    FILE *out = NULL;
+    char name[32];
+    const char *mark;
+    uint64_t checksum, first, golden;
+    double tick, low, high;
+    unsigned long ticks;
+    int opt, k, level, count, differ = 0;
+
+    while ((opt = getopt(argc, argv, "L:k:n:r:s:b:c:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'L':
+                Levels = world_open_pack(optarg, &LevelsCount);
+                if (Levels == NULL)
+                    Levels = world_read_levels(optarg, &LevelsCount);
+                if (Levels == NULL)
+                {
+                    fprintf(stderr, "%s: can't read levels from %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                Kernel = world_kernel(optarg);
+                if (Kernel < 0)
+                {
+                    fprintf(stderr, "%s: unknown or unsupported kernel %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                Ticks = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                Runs = atoi(optarg);
+                break;
+            case 's':
+                Seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                Only = optarg;
+                break;
+            case 'c':
+                CheckPath = optarg;
+                break;
+            case 'w':
+                WritePath = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-L levels] [-k kernel] [-n ticks] "
+                    "[-r runs] [-s seed] [-b name] [-c golden] [-w golden]\n",
+                    argv[0]);
+                return 1;
+        }
+    }
+
+    if (Levels == NULL)
+    {
+        Levels = (struct level*)BuiltinLevels();
+        LevelsCount = LEVELS_NUMBERS;
+    }
+    if (Runs < 1)
+        Runs = 1;
+    if (Ticks < 1)
+        Ticks = 1;
+    if (CheckPath != NULL && ReadGolden(CheckPath) < 0)
+    {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], CheckPath);
+        return 1;
+    }
+    if (WritePath != NULL && (out = fopen(WritePath, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: can't write %s\n", argv[0], WritePath);
+        return 1;
+    }
+
+    l = BenchLevels();
+    s = calloc(Runs, sizeof(struct sample));
+    if (l == NULL || s == NULL)
+    {
+        fprintf(stderr, "%s: no memory\n", argv[0]);
+        return 1;
+    }
+    count = LevelsCount + SYNTHETIC_LEVELS;
+    render_init(&View, RenderThemes);
+    View.fd = -1;
+
+    printf("median of %d runs, %s kernel, nanoseconds\n", Runs,
+        KernelNames[KernelSupported(Kernel)]);
+    printf("%-11s %9s %6s %9s %8s %8s %19s %9s %6s %7s %7s %5s %6s  %s\n",
+        "", "size", "ticks", "load", "restart", "tick", "(runs)", "ticks/s",
+        "crash", "rocks", "boxes", "find", "view", "checksum");
+    for (level = 0; level < count; level++)
+    {
+        if (level < LevelsCount)
+            snprintf(name, sizeof(name), "level-%02d", level + 1);
+        else
+            snprintf(name, sizeof(name), "%s",
+                SyntheticLevels[level - LevelsCount].name);
+        if (Only != NULL && strcmp(Only, name))
+            continue;
+        ticks = Ticks;
+        if (level >= LevelsCount && SyntheticLevels[level - LevelsCount].seconds
+            && Ticks > (unsigned long)SyntheticLevels[level - LevelsCount].seconds
+                       * (INTER_TIME + 1))
+            ticks = SyntheticLevels[level - LevelsCount].seconds * (INTER_TIME + 1);
+
+        first = 0;
+        for (k = 0; k < Runs; k++)
+        {
+            checksum = Run(l, count, level, ticks, &s[k]);
+            if (k == 0)
+                first = checksum;
+            else if (checksum != first)
+                first = 0; // Not the same game every time
+        }
+        if (first == 0)
+        {
+            printf("%-11s doesn't play the same every time, or doesn't fit "
+                "in memory\n", name);
+            differ++;
+            continue;
+        }
+
+        golden = GoldenOf(name, ticks);
+        mark = "";
+        if (CheckPath != NULL && golden == 0)
+            mark = " new";
+        else if (CheckPath != NULL && golden != first)
+        {
+            mark = " DIFFERS";
+            differ++;
+        }
+        if (out != NULL)
+            fprintf(out, "%s %lu %llu %016llx\n", name, ticks, Seed,
+                (unsigned long long)first);
+
+        tick = Median(s, Runs, offsetof(struct sample, tick), &low, &high);
+        printf("%-11s %4dx%-4d %6lu %9.0f %8.0f %8.0f (%8.0f..%8.0f) %9.0f "
+            "%6.0f %7.0f %7.0f %5.1f %6.0f  %016llx%s\n", name,
+            l[level].width, l[level].height, ticks,
+            Median(s, Runs, offsetof(struct sample, load), NULL, NULL),
+            Median(s, Runs, offsetof(struct sample, restart), NULL, NULL),
+            tick, low, high, 1e9 / tick,
+            Median(s, Runs, offsetof(struct sample, phase[PHASE_CRASH]), NULL, NULL),
+            Median(s, Runs, offsetof(struct sample, phase[PHASE_ROCKS]), NULL, NULL),
+            Median(s, Runs, offsetof(struct sample, phase[PHASE_BOXES]), NULL, NULL),
+            Median(s, Runs, offsetof(struct sample, find), NULL, NULL),
+            Median(s, Runs, offsetof(struct sample, view), NULL, NULL),
+            (unsigned long long)first, mark);
+    }
+
+    if (out != NULL && fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: can't write %s\n", argv[0], WritePath);
+        return 1;
+    }
+    if (CheckPath != NULL && differ)
+        printf("%d checksums differ from %s\n", differ, CheckPath);
+    else if (CheckPath != NULL)
+        printf("all checksums as in %s\n", CheckPath);
+    return differ ? 1 : 0;
+}
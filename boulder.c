@@ -1,716 +1,586 @@
-/* 
+/*
  * Boulder Palm
- * Copyright (C) 2001-2020 by Wojciech Martusewicz 
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
  */
 
 #include "tools.h"
-#include "levels.h"
-
-#define SCREEN_SIZE_X       40
-#define SCREEN_SIZE_Y       22
-
-#define X_MARGIN            0
-#define Y_MARGIN            0
-
-#define TILE_SIZE           1
-#define BITMAP_MAX          14  // Number of bitmaps to load
-
-#if (SCREEN_SIZE_X / TILE_SIZE) < LEVELS_WIDTH
-    #define BOARD_WIDTH     (SCREEN_SIZE_X / TILE_SIZE)
-#else
-    #define BOARD_WIDTH     LEVELS_WIDTH
-#endif
-#if (SCREEN_SIZE_Y / TILE_SIZE) < LEVELS_HIGH - 1 // -1 for bottom margin
-    #define BOARD_HIGH      ((SCREEN_SIZE_Y / TILE_SIZE) - 1)
-#else
-    #define BOARD_HIGH      LEVELS_HIGH
-#endif
+#include "world.h"
+#include "render.h"
+#include "pack.h"
+#include "replay.h"
+#include "undo.h"
+#include "profile.h"
+#include "ticker.h"
+#include "input.h"
+#include "broadcast.h"
+#include "trace.h"
+#include <getopt.h>
+#include <math.h>
 
 #define STANDARD_DELAY      1000
-#define INTER_TIME          60
-
-enum tile {TUNNEL, WALL, HERO, ROCK, DIAMOND, GROUND, METAL, BOX, DOOR, FLY, 
-           CRASH};
-enum hero {KILLED, FACE1, FACE2, RIGHT, LEFT};
-enum sound {SOUND_NONE, SOUND_MOVE, SOUND_DIAMOND, SOUND_EXPLOSION};
-enum direction {NORTH, EAST, SOUTH, WEST};
-enum move {REAL, GHOST};
-enum box_state {STILL, MOVING};
-enum side {FALL_LEFT = -1, FALL_RIGHT = 1};
-
-struct game
-{
-    int current_level;
-    int level_diamonds;   // Total number of diamonds to pick up
-    int level_time;       // Total time to pass the board
-    int diamonds;         // Diamonds left
-    int time;             // Time left
-    enum hero hero_state; // Direction of player
-    enum move move_mode;  // Move mode (real move or action without move)
-    int lastposx, lastposy;
-    int move_time;        // Time of last move (impatience feature)
-    int sound_mode;
-    enum sound sound_to_play;
-};
-
-struct board_mem
-{
-    unsigned char board:4;
-    unsigned char rock_move:1;
-    unsigned char box_move:1;
-    unsigned char box_dir:2;
-};
 
 /********************
  * Global variables *
  ********************/
-struct game Game;
-unsigned char Mem[LEVELS_HIGH][LEVELS_WIDTH];
+struct renderer Screen;
+int ShowStats = 0;        // Print the frame statistics on exit
+int Kernel = KERNEL_AUTO; // Rock kernel
+int Verify = 0;           // Check every tick against the scalar rock kernel
+struct level *Levels;     // Levels read from a file, or the built in ones
+int LevelsCount;
+char *PackPath;           // Write the levels as a pack there and quit
+unsigned long long Seed = WORLD_SEED; // Seed of the rocks rolling aside
+unsigned long Tick;       // Ticks of the game clock so far
+struct replay Recorder;   // Keys of the game, when recorded
+char *RecordPath;         // Record the game there
+struct undo Undo;         // The last half a minute, for the undo key
+char *ReplayPath;         // Play this replay with no terminal and quit
+unsigned long ReplayTo = REPLAY_ALL; // Tick to stop the replay at
+int ReplayHashes = 0;     // Print the digest of every tick played
+struct profile Profile;   // Times of the phases of the frames
+char *ProfilePath;        // Write them there as JSON on exit
+struct ticker Ticker;     // When the ticks are due
+int CatchUp = TICKER_CATCH_UP; // Late ticks played in a row at most
+struct input Input;       // Keys read and not played yet
+int Stepped;              // The hero has moved this tick
+struct broadcast Spectators; // The frames sent to boulder-watch
+char *BroadcastPath;      // Socket they connect to
+struct trace Trace;       // The frames and keys written out, when traced
+char *TracePath;
+int TraceFileFormat = TRACE_ASCIICAST; // enum trace_format
+int Scroll = -1;          // enum render_scroll, -1 asks the terminal
+const struct render_theme *Theme = RenderThemes; // Glyphs and colors of the tiles
+
+struct option LongOptions[] =
+{
+    {"replay", required_argument, NULL, 'R'},
+    {"to",     required_argument, NULL, 'T'},
+    {"record", required_argument, NULL, 'r'},
+    {"hashes", no_argument,       NULL, 'H'},
+    {"profile", required_argument, NULL, 'F'},
+    {"catch-up", required_argument, NULL, 'C'},
+    {"broadcast", required_argument, NULL, 'B'},
+    {"trace", required_argument, NULL, 'X'},
+    {"trace-format", required_argument, NULL, 'Y'},
+    {"scroll", required_argument, NULL, 'Z'},
+    {"theme", required_argument, NULL, 'Q'},
+    {NULL, 0, NULL, 0}
+};
 
 
-/*********************************************
- * Access (get/set) to game board properties *
- *********************************************/
-int GetBoard(int h, int w)
+/******************
+ * Play the sound *
+ ******************/
+void SoundPlay(struct world *w)
 {
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    return b->board;
-}
+    if (w->game.sound_mode && w->game.sound_to_play != SOUND_NONE)
+    {
+        // TODO: Play the sound...
+        switch (w->game.sound_to_play)
+        {
+            case SOUND_MOVE:
+                break;
+            case SOUND_DIAMOND:
+                make_beep();
+                break;
+            case SOUND_EXPLOSION:
+                break;
+            case SOUND_NONE:
+                break;
+        }
 
-void SetBoard(int h, int w, int v)
-{
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    b->board = v;
+        w->game.sound_to_play = SOUND_NONE;
+    }
 }
 
-int GetRockMove(int h, int w)
-{
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    return b->rock_move;
-}
 
-void SetRockMove(int h, int w, int v)
+/***************************************************************
+ * The frame just flushed goes to the spectators and the trace *
+ ***************************************************************/
+void SendFrame(void)
 {
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    b->rock_move = v;
-}
+    const char *frame;
+    int n;
 
-int GetBoxMove(int h, int w)
-{
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    return b->box_move;
+    broadcast_frame(&Spectators);
+    frame = render_frame(&Screen, &n);
+    if (n > 0 && (frame == NULL || trace_frame(&Trace, frame, n) < 0))
+        render_invalidate(&Screen); // Lost, the next frame is a whole one
 }
 
-void SetBoxMove(int h, int w, int v)
-{
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    b->box_move = v;
-}
 
-int GetBoxDir(int h, int w)
+/**********************************************************
+ * This function draw currently visable part of the board *
+ **********************************************************/
+void ShowView(struct world *w)
 {
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    return b->box_dir;
-}
+    uint64_t t = profile_clock(&Profile);
 
-void SetBoxDir(int h, int w, int v)
-{
-    struct board_mem *b = (struct board_mem*)&(Mem[h][w]);
-    b->box_dir = v;
+    if (w->dirty & WORLD_DIRTY_VIEW) // Else the status line alone
+    {
+        render_view(&Screen, w);
+        if (Profile.overlay)
+            profile_overlay(&Profile, &Screen);
+    }
+    t = profile_mark(&Profile, PROFILE_VIEW, t);
+    render_flush(&Screen);
+    if (Profile.on)
+    {
+        profile_add(&Profile, PROFILE_FLUSH, ProfileNow() - t - Screen.write_ns);
+        profile_add(&Profile, PROFILE_WRITE, Screen.write_ns);
+    }
+    SendFrame();
 }
 
 
-/*****************
- * Loading level *
- *****************/
-int LoadLevel(int level)
+/*********************************
+ * Write time, score, etc status *
+ *********************************/
+void ShowStatus(struct world *w, int events)
 {
-    int j, i;
-
-    if (level >= LEVELS_NUMBERS || level < 0)
-        return -1;
+    char txt[32];
 
-    for (j = 0; j <= LEVELS_HIGH - 1; j++)
+    if (events & WORLD_GAME_OVER)
     {
-        for (i = 0; i <= LEVELS_WIDTH - 1; i++)
-        {
-            char t = (levels[level][j][i]);
-            SetBoard(j, i, t - 48);
-        }
+        render_text(&Screen, STATUS_ROW, "   * Game Over *    ");
+    } else
+    if (events & WORLD_LEVEL_DONE)
+    {
+        Sleep(STANDARD_DELAY);
+        sprintf(txt, "    * Level %02d *    ", w->game.current_level + 1);
+        render_text(&Screen, STATUS_ROW, txt);
+        render_flush(&Screen);
+        SendFrame();
+        Sleep(STANDARD_DELAY);
+        ticker_resume(&Ticker); // The pause isn't lateness to catch up
+    } else
+    {
+        sprintf(txt, "L:%02d,D:%03d,T:%03d,M:%d", w->game.current_level + 1,
+            w->game.diamonds, w->game.time, w->game.sound_mode);
+        render_text(&Screen, STATUS_ROW, txt);
     }
-
-    Game.level_diamonds = levels_diamonds[level];
-    Game.level_time = levels_time[level];
-   
-    return 0;
 }
 
 
-/**************************************
- * This function starts the new board *
- **************************************/
-void StartLevel(int new_level)
+/******************************************************
+ * Draw what has changed since the last frame, if any *
+ ******************************************************/
+void ShowChanges(struct world *w, int events)
 {
-    if (LoadLevel(new_level) < 0)
-        if (Game.current_level != 0)
-        {
-            Game.current_level = 0;
-            StartLevel(Game.current_level);
-        }
-    Game.time = Game.level_time;
-    Game.move_time = Game.level_time;
-    Game.diamonds = Game.level_diamonds;
-    Game.hero_state = FACE1;
-}
-
+    uint64_t t;
 
-/******************
- * Play the sound *
- ******************/
-void SoundPlay(void)
-{
-    if (Game.sound_mode && Game.sound_to_play != SOUND_NONE)
+    if (w->dirty & WORLD_DIRTY_STATUS || events & (WORLD_GAME_OVER | WORLD_LEVEL_DONE))
     {
-        // TODO: Play the sound...
-        switch (Game.sound_to_play)
-        {
-            case SOUND_MOVE:
-                break;
-            case SOUND_DIAMOND:
-                make_beep(); 
-                break;
-            case SOUND_EXPLOSION:
-                break;
-            case SOUND_NONE:
-                break;
-        }
-
-        Game.sound_to_play = SOUND_NONE;
+        t = profile_clock(&Profile);
+        ShowStatus(w, events);
+        profile_mark(&Profile, PROFILE_STATUS, t);
+        w->dirty |= WORLD_DIRTY_STATUS;
     }
+    if (!w->dirty)
+        return;
+    ShowView(w);
+    w->dirty = 0;
+
+    t = profile_clock(&Profile);
+    SoundPlay(w);
+    profile_mark(&Profile, PROFILE_SOUND, t);
 }
 
 
-/****************************
- * Set the sound to be play *
- ****************************/
-void SoundRequest(int sound)
+/**********************
+ * Refreash the Board *
+ **********************/
+void RefreashBoard(struct world *w)
 {
-    Game.sound_to_play = sound;
+    int events = world_step(w);
+
+    profile_world(&Profile, events);
+    if (Profile.overlay && events & WORLD_REFRESH)
+        w->dirty |= WORLD_DIRTY_VIEW; // The overlay has new numbers
+    ShowChanges(w, events);
 }
 
 
 /******************
- * Make the crash *
+ * Show the intro *
  ******************/
-void MakeCrash(int object, int y, int x)
+void ShowIntro(void)
 {
-    int j, i;
-
-    for (j = y - 1; j <= y + 1; j++)
-        for (i = x - 1; i <= x + 1; i++)
-            if (GetBoard(j, i) != METAL) 
-                SetBoard(j, i, object);
-
-    SoundRequest(SOUND_EXPLOSION);
+//    printf("Boulder start");
+//    Sleep(STANDARD_DELAY);
 }
 
 
 /********************
- * Remove the crash *
+ * Start aplication *
  ********************/
-void CrashRemove(void)
+struct world *StartAplication(void)
 {
-    int j, i;
+    init_game_terminal();
+    render_init(&Screen, Theme);
+    if (Scroll < 0)
+        render_probe(&Screen, 0);
+    else
+        Screen.scroll = Scroll;
 
-    for (j = LEVELS_HIGH - 2; j > 0; j--)
-        for (i = 0; i <= LEVELS_WIDTH - 1; i++)
-            if (GetBoard(j, i) == CRASH)
-                SetBoard(j, i, TUNNEL);
+    ShowIntro();
+    return world_create_levels(Levels, LevelsCount, 0);
 }
 
 
-/***************************************************
- * This function control each other box and fly AI *
- ***************************************************/
-int MoveBox(int j, int i, int d)
+/***************************************
+ * Print the frame statistics on exit *
+ ***************************************/
+void PrintStats(void)
 {
-    int dj = j, di = i;
-
-    if (d > WEST)
-        d -= (WEST + 1);
-    if (d < NORTH)
-        d = WEST;
+    struct render_stats *s = &Screen.stats;
+    struct ticker_stats *t = &Ticker.stats;
+    double mean, sec;
 
-    switch (d)
-    {
-        case NORTH: dj -= 1; break;
-        case EAST:  di += 1; break;
-        case SOUTH: dj += 1; break;
-        case WEST:  di -= 1; break;
-    }
+    if (!ShowStats)
+        return;
 
-    if (GetBoard(dj, di) == HERO)
+    if (s->frames)
     {
-        if (GetBoard(j, i) == BOX)
-            MakeCrash(CRASH, dj, di);
-        else
-            MakeCrash(DIAMOND, dj, di);
-        return 1;
+        fprintf(stderr, "frames: %lu, %lu shifted by the terminal, %lu SGR "
+            "sequences\n", s->frames, s->shifts, s->attrs);
+        fprintf(stderr, "bytes/frame: %llu avg, %lu max\n",
+            s->bytes / s->frames, s->bytes_max);
+        fprintf(stderr, "us/frame: %.1f avg, %.1f max\n",
+            s->ns / 1000.0 / s->frames, s->ns_max / 1000.0);
     }
-
-    if (GetBoard(dj, di) == TUNNEL)
+    if (t->wakes)
     {
-        if (GetBoard(j, i) == BOX)
-            SetBoard(dj, di, BOX);
-        else
-            SetBoard(dj, di, FLY);
-        SetBoard(j, i, TUNNEL);
-        SetBoxMove(dj, di, MOVING);
-        SetBoxDir(dj, di, d);
-        return 1;
+        mean = t->jitter / t->wakes;
+        sec = (TickerNow() - t->start) / 1e9;
+        fprintf(stderr, "ticks: %lu in %.1f s, %.2f a second\n", t->ticks, sec,
+            sec > 0 ? t->ticks / sec : 0);
+        fprintf(stderr, "us late on waking: %.1f avg, %.1f sd, %.1f max\n",
+            mean / 1000, sqrt(t->jitter_sq / t->wakes - mean * mean) / 1000,
+            t->jitter_max / 1000.0);
+        fprintf(stderr, "ticks caught up: %lu, skipped: %lu, slept through: %lu\n",
+            t->caught_up, t->skipped, t->slept);
+        fprintf(stderr, "wakes: %lu, %.2f a second\n", t->wakes,
+            sec > 0 ? t->wakes / sec : 0);
     }
-
-    return 0;
+    if (Input.stats.reads)
+        fprintf(stderr, "keys: %lu in %lu reads, %lu sequences, %lu dropped\n",
+            Input.stats.keys, Input.stats.reads, Input.stats.sequences,
+            Input.stats.dropped);
+    if (Spectators.stats.spectators)
+        fprintf(stderr, "spectators: %lu, frames %lu, keyframes %lu, %llu bytes, "
+            "%lu slow, %lu dropped\n", Spectators.stats.spectators,
+            Spectators.stats.frames, Spectators.stats.keyframes,
+            Spectators.stats.bytes, Spectators.stats.slow,
+            Spectators.stats.dropped);
+    if (Trace.stats.frames + Trace.stats.frames_dropped)
+        fprintf(stderr, "trace: %lu frames, %lu keys, dropped %lu frames, %lu "
+            "keys, %llu bytes in %lu writes, %lu syncs\n", Trace.stats.frames,
+            Trace.stats.keys, Trace.stats.frames_dropped, Trace.stats.keys_dropped,
+            Trace.stats.bytes, Trace.stats.writes, Trace.stats.syncs);
 }
 
 
-/**********************************************
- * This function control boxs's and flys's AI *
- **********************************************/
-void MoveBoxes(void)
+void StopRecording(void)
 {
-    int j, i, d;
-
-    for (j = LEVELS_HIGH - 2; j > 0; j--)
-        for (i = 1; i < LEVELS_WIDTH - 1; i++)
-            SetBoxMove(j, i, STILL);
-
-    for (j = LEVELS_HIGH - 2; j > 0; j--)
-        for (i = 1; i < LEVELS_WIDTH - 1; i++)
-            if ((GetBoard(j, i) == BOX || GetBoard(j, i) == FLY) 
-                && GetBoxMove(j, i) == STILL)
-            {
-                for (d = GetBoxDir(j, i) - 1; d <= GetBoxDir(j, i) + 2; d++)
-                    if (MoveBox(j, i, d))
-                        break;
-            }
+    replay_close(&Recorder, Tick);
 }
 
 
-/*******************************************
- * Falling rock and diamonds on given side *
- *******************************************/
-void FallingOnSide(int j, int i, int side)
+void StopBroadcast(void)
 {
-    if (GetBoard(j, i + side) == TUNNEL 
-        && GetBoard(j + 1, i + side) == TUNNEL)
-    {
-        SetBoard(j, i + side, GetBoard(j, i));
-        SetBoard(j, i, TUNNEL);
-        SetRockMove(j, i + side, MOVING);
-    }
+    broadcast_close(&Spectators);
 }
 
 
-/***************************************************
- * This function control rock and diamonds falling *
- ***************************************************/
-void MoveRocks(void)
+void StopTrace(void)
 {
-    int j, i;
-
-    for (j = LEVELS_HIGH - 2; j > 0; j--)
-        for (i = (j % 2) ? LEVELS_WIDTH - 2 : 1;
-             (j % 2) ? i > 0 : i < LEVELS_WIDTH - 1;
-             (j % 2) ? i-- : i++)
-        {
-            if (GetBoard(j, i) == ROCK || GetBoard(j, i) == DIAMOND)
-            {
-                // Falling rock or diamond on right or left
-                if (GetBoard(j + 1, i) == ROCK
-                    || GetBoard(j + 1, i) == DIAMOND
-                    || GetBoard(j + 1, i) == WALL
-                    || GetBoard(j + 1, i) == DOOR
-                    || GetBoard(j + 1, i) == METAL)
-                {
-                    if (rand() & 1)
-                        FallingOnSide(j, i, FALL_RIGHT);                        
-                    else
-                        FallingOnSide(j, i, FALL_LEFT);
-                }
-
-                // Falling down
-                if (GetBoard(j + 1, i) == TUNNEL)
-                {
-                    SetBoard(j + 1, i, GetBoard(j, i));         
-                    SetBoard(j, i, TUNNEL);
-                    SetRockMove(j + 1, i, MOVING);
-                }
-
-                // Rock or diamond kills the player
-                if (GetBoard(j + 1, i) == HERO && GetRockMove(j, i) == MOVING)
-                    MakeCrash(CRASH, j + 1, i);
-                
-                // Rock or diamond kills the BOX
-                if (GetBoard(j + 1, i) == BOX)
-                    MakeCrash(CRASH, j + 1, i);
-                if (GetBoard(j + 1, i) == FLY)
-                    MakeCrash(DIAMOND, j + 1, i);
-
-                SetRockMove(j, i, STILL);
-            }
-        }
+    if (trace_close(&Trace) < 0)
+        fprintf(stderr, "can't write the trace to %s: %s\n", TracePath,
+            strerror(Trace.stats.error));
 }
 
 
-/**********************************
- * This function finds the object *
- **********************************/
-int FindObject(int object, int *y, int *x)
+void DumpProfile(void)
 {
-    int j, i;
-
-    for (j = 1; j < LEVELS_HIGH - 1; j++)
-        for (i = 1; i < LEVELS_WIDTH - 1; i++)
-            if (GetBoard(j, i) == object)
-            {
-                if (y != 0)
-                    *y = j;
-                if (x != 0)
-                    *x = i;
-                return object; // Object found
-            }
-    return (-1); // Object not found
+    if (profile_dump(&Profile, ProfilePath) < 0)
+        fprintf(stderr, "can't write the profile to %s\n", ProfilePath);
 }
 
 
-/**********************************
- * This function moves the player *
- **********************************/
-void MoveHero(int y, int x)
+/*************************************
+* Handle a key press from the player *
+ *************************************/
+void HandleKey(struct world *w, int key)
 {
-    int j, i, o;
-
-    if (FindObject(HERO, &j, &i) != HERO)
-        return;
-
-    o = GetBoard(j + y, i + x);
-
-    switch (o)
+    trace_key(&Trace, key);
+    if (key == 'q')
+        exit(0);
+    if (key == 'o') // The profiler overlay, timing starts with it
     {
-        case DIAMOND: // Get the diamond
-            if (Game.diamonds)
-                Game.diamonds--;
-            SoundRequest(SOUND_DIAMOND);
-            break;      
-        case ROCK: // Push the rock
-            if (x > 0)
-                if (GetBoard(j, i + x + 1) == TUNNEL)
-                {
-                    SetBoard(j, i + x, TUNNEL);
-                    SetBoard(j, i + x + 1, ROCK);
-                }
-            if (x < 0)
-                if (GetBoard(j, i + x - 1) == TUNNEL)
-                {
-                    SetBoard(j, i + x, TUNNEL);
-                    SetBoard(j, i + x - 1, ROCK);
-                }
-            o = GetBoard(j + y, i + x);
-            break;
-        case BOX:
-            MakeCrash(CRASH, j + y, i + x);
-            return;
-        case FLY:
-            MakeCrash(DIAMOND, j + y, i + x);
-            return;
+        profile_start(&Profile, w);
+        Profile.overlay ^= 1;
+        w->dirty |= WORLD_DIRTY_VIEW;
+        return;
     }
-
-    // Move player if it's possible
-    if (o != WALL && o != ROCK && o != METAL
-         && j + y >= 0 && i + x >= 0 
-         && j + y < LEVELS_HIGH && i + x < LEVELS_WIDTH
-         && (o != DOOR || !Game.diamonds))
+    if (key == 'u') // Undo, the replay gets the world it went back to
     {
-        if (Game.move_mode == REAL)
-        {
-            SetBoard(j, i, TUNNEL);
-            SetBoard(j + y, i + x, HERO);
-        } else
-        {
-            SetBoard(j + y, i + x, TUNNEL);
-        }
-        if (Game.sound_to_play == SOUND_NONE)
-            SoundRequest(SOUND_MOVE);
+        if (undo_pop(&Undo, w) == 0)
+            replay_undo(&Recorder, Tick, w);
+        return;
     }
+    replay_key(&Recorder, Tick, key);
 
-    Game.move_mode = REAL;
-    Game.move_time = Game.time;
-    return;
+    Stepped = world_key(w, key);
 }
 
 
-/***************
- * Kill player *
- ***************/
-void KillHero(void)
+/****************************************************************
+ * Play the keys waiting in the queue, up to one move a tick as *
+ * the hero always moved: the keys after it wait for the next   *
+ * tick                                                         *
+ ****************************************************************/
+void KeyDown(struct world *w)
 {
-    int y, x;
+    int key;
 
-    if (FindObject(HERO, &y, &x) == HERO)
-        MakeCrash(CRASH, y, x);
+    while (!Stepped && (key = input_key(&Input)) >= 0)
+        HandleKey(w, key);
 }
 
 
-char SelectTile(int item, int posx, int posy)
+/****************************************************
+ * Play the keys and show what they did, timed from *
+ * "start"                                          *
+ ****************************************************/
+void PlayKeys(struct world *w, uint64_t start)
 {
-    char t;
-
-    switch (item)
-    {
-        case 0: t = ' '; break; // TUNNEL
-        case 1: t = '='; break; // WALL
-        case 2: t = 'R'; break; // HERO
-        case 3: t = 'o'; break; // ROCK
-        case 4: t = '*'; break; // DIAMOND
-        case 5: t = '~'; break; // GROUND
-        case 6: t = '#'; break; // METAL
-        case 7: t = '@'; break; // BOX
-        case 8: t = '>'; break; // DOOR
-        case 9: t = '%'; break; // FLY
-        case 10: t = '^'; break; //CRASH
-        default: t = 'R';
-    }
-
-    return t;
+    KeyDown(w);
+    profile_mark(&Profile, PROFILE_INPUT, start);
+    ShowChanges(w, 0);
 }
 
-/**********************************************************
- * This function draw currently visable part of the board *
- **********************************************************/
-void ShowView(void)
-{
-    int starty, startx, posy, posx, y, x;
 
-    /* Find the player */
-    if (FindObject(HERO, &starty, &startx) < 0)
-    {
-        startx = Game.lastposx;
-        starty = Game.lastposy;
-        Game.hero_state = KILLED;
-    } else
-    {
-        Game.lastposx = startx;
-        Game.lastposy = starty;
-    }
+int main(int argc, char *argv[])
+{
+    struct world *w;
+    struct pollfd wake[2];
+    int opt, due, quiet;
 
-    // Scrolling the board
-    startx -= BOARD_WIDTH / 2;
-    if (startx < 0)
-        startx = 0;
-    if (startx > LEVELS_WIDTH - BOARD_WIDTH)
-        startx = LEVELS_WIDTH - BOARD_WIDTH;
-
-    starty -= BOARD_HIGH / 2;
-    if (starty < 0)
-        starty = 0;
-    if (starty > LEVELS_HIGH - BOARD_HIGH)
-        starty = LEVELS_HIGH - BOARD_HIGH;
-
-    // Draw the board
-    init_drawing();
-    posy = starty;
-    for (y = 0; y < BOARD_HIGH; y++)
+    while ((opt = getopt_long(argc, argv, "Sk:VL:P:s:r:", LongOptions, NULL)) != -1)
     {
-        posx = startx;
-        for (x = 0; x < BOARD_WIDTH; x++)
+        switch (opt)
         {
-            int t = SelectTile(GetBoard(posy, posx), x, y);
-            printf("%c", t);
-            posx++;
+            case 'S':
+                ShowStats = 1;
+                break;
+            case 'k':
+                Kernel = world_kernel(optarg);
+                if (Kernel < 0)
+                {
+                    fprintf(stderr, "%s: unknown or unsupported kernel %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'V':
+                Verify = 1;
+                break;
+            case 'L':
+                Levels = world_open_pack(optarg, &LevelsCount);
+                if (Levels == NULL)
+                    Levels = world_read_levels(optarg, &LevelsCount);
+                if (Levels == NULL)
+                {
+                    fprintf(stderr, "%s: can't read levels from %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                PackPath = optarg;
+                break;
+            case 's':
+                Seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                RecordPath = optarg;
+                break;
+            case 'R':
+                ReplayPath = optarg;
+                break;
+            case 'T':
+                ReplayTo = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                ReplayHashes = 1;
+                break;
+            case 'F':
+                ProfilePath = optarg;
+                break;
+            case 'C':
+                CatchUp = atoi(optarg);
+                break;
+            case 'B':
+                BroadcastPath = optarg;
+                break;
+            case 'X':
+                TracePath = optarg;
+                break;
+            case 'Y':
+                if (!strcmp(optarg, "asciicast"))
+                    TraceFileFormat = TRACE_ASCIICAST;
+                else if (!strcmp(optarg, "binary"))
+                    TraceFileFormat = TRACE_BINARY;
+                else
+                {
+                    fprintf(stderr, "%s: unknown trace format %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                if (!strcmp(optarg, "auto"))
+                    Scroll = -1;
+                else if (!strcmp(optarg, "off"))
+                    Scroll = RENDER_SCROLL_NONE;
+                else if (!strcmp(optarg, "rows"))
+                    Scroll = RENDER_SCROLL_ROWS;
+                else if (!strcmp(optarg, "margins"))
+                    Scroll = RENDER_SCROLL_MARGINS;
+                else
+                {
+                    fprintf(stderr, "%s: unknown scroll %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'Q':
+                Theme = render_find_theme(optarg);
+                if (Theme == NULL)
+                {
+                    fprintf(stderr, "%s: unknown theme %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-S] [-k kernel] [-V] [-L levels] "
+                    "[-P pack] [-s seed] [-r replay] [--profile json]\n"
+                    "       [--catch-up ticks] [--broadcast socket]\n"
+                    "       [--trace file [--trace-format asciicast|binary]]\n"
+                    "       [--scroll auto|off|rows|margins] [--theme plain|color|unicode]\n"
+                    "       %s --replay file [--to tick] [--hashes] [-L levels]\n",
+                    argv[0], argv[0]);
+                return 1;
         }
-        printf("\n");
-        posy++;
     }
-}
-
-
-/*******************************************************
- * Write time, score, etc and end of the Game checking *
- *******************************************************/
-void ShowStatus(void)
-{
-    char txt[21];
 
-    if (!Game.time)
-    {
-        KillHero();
-        printf("   * Game Over *    \n");
-    } else
-    if (!Game.diamonds && FindObject(DOOR, 0, 0) < 0)
-    {
-        Sleep(STANDARD_DELAY);
-        sprintf(txt, "    * Level %02d *    \n", Game.current_level + 2);
-        printf("%s", txt);
-        Sleep(STANDARD_DELAY);
-        StartLevel(++Game.current_level);
-    } else
+    if (Levels == NULL)
     {
-        sprintf(txt, "L:%02d,D:%03d,T:%03d,M:%d\n", Game.current_level + 1, 
-            Game.diamonds, Game.time, Game.sound_mode);
-        printf("%s", txt);
+        Levels = (struct level*)BuiltinLevels();
+        LevelsCount = LEVELS_NUMBERS;
     }
-}
 
+    if (ReplayPath != NULL)
+        return replay_play(ReplayPath, Levels, LevelsCount, ReplayTo,
+                           ReplayHashes ? stdout : NULL) < 0;
 
-/**********************
- * Refreash the Board *
- **********************/
-void RefreashBoard(void)
-{
-    static int t = 0;
-
-    if (!t--)
+    if (PackPath != NULL)
     {
-        CrashRemove();
-        MoveRocks();
-        MoveBoxes();
-        ShowStatus();
-        ShowView();
-        SoundPlay();
-        t = INTER_TIME / 5; // The speed of moving objects
+        if (world_write_pack(PackPath, Levels, LevelsCount) < 0)
+        {
+            fprintf(stderr, "%s: can't write %s\n", argv[0], PackPath);
+            return 1;
+        }
+        return 0;
     }
-}
 
-
-/*********************
- * Time decrementing *
- *********************/
-void DecrementTime(void)
-{
-    static int t = INTER_TIME;
-
-    if (Game.time <= 0 || Game.hero_state == KILLED)
-        return;
-
-    switch (t--)
+    if (RecordPath != NULL)
     {
-        case 0:
-            Game.time--;
-            t = INTER_TIME;
-        case INTER_TIME / 2:
-            if (Game.hero_state == FACE1 && Game.move_time - Game.time > 5)
-                Game.hero_state = FACE2;
-            else
-                Game.hero_state = FACE1;
+        if (replay_create(&Recorder, RecordPath, Seed, 0, LevelsCount) < 0)
+        {
+            fprintf(stderr, "%s: can't write %s\n", argv[0], RecordPath);
+            return 1;
+        }
+        atexit(StopRecording);
     }
-}
-
-
-/******************
- * Show the intro *
- ******************/
-void ShowIntro(void)
-{
-//    printf("Boulder start");
-//    Sleep(STANDARD_DELAY);
-}
-
-
-/********************
- * Start aplication *
- ********************/
-void StartAplication(void)
-{
-    init_game_terminal();
-
-    Game.current_level = 0;
-    Game.diamonds      = 0;
-    Game.move_mode     = REAL;
-    Game.sound_mode    = 1;
-    Game.sound_to_play = SOUND_NONE;
-
-    ShowIntro();
-    StartLevel(Game.current_level);
-}
 
+    broadcast_init(&Spectators);
+    if (BroadcastPath != NULL)
+    {
+        if (broadcast_open(&Spectators, BroadcastPath, &Screen) < 0)
+        {
+            fprintf(stderr, "%s: can't listen on %s\n", argv[0], BroadcastPath);
+            return 1;
+        }
+        atexit(StopBroadcast);
+    }
 
-/*************************************
-* Handle a key press from the player *
- *************************************/
-int KeyDown(void)
-{
-    int key = getkey();
+    if (undo_init(&Undo, Levels, LevelsCount) < 0)
+        fprintf(stderr, "%s: no memory for undo, playing without\n", argv[0]);
 
-    switch (key)
+    atexit(PrintStats); // Registered first, runs after terminal restore
+    Trace.fd = -1;
+    if (TracePath != NULL)
     {
-        case 'a':
-        case 68:
-            MoveHero(0, -1);
-            Game.hero_state = LEFT;
-            return 1;
-        case 'd':
-        case 67:
-            MoveHero(0, 1);
-            Game.hero_state = RIGHT;
-            return 1;
-        case 'w':
-        case 65:
-            MoveHero(-1, 0);
-            return 1;
-        case 's':
-        case 66:
-            MoveHero(1, 0);
+        if (trace_open(&Trace, TracePath, TraceFileFormat) < 0)
+        {
+            fprintf(stderr, "%s: can't write %s\n", argv[0], TracePath);
             return 1;
-        case 32: case 13: // Spacebar, Return
-            if (Game.hero_state == KILLED)
-                StartLevel(Game.current_level);
-            else
-                Game.move_mode = GHOST;
-            break;
-        case 'm':
-            Game.sound_mode ^= 1;
-            break;
-        case 'n':
-            StartLevel(++Game.current_level);
-            break;
-        case 'p':
-            if (Game.current_level > 0)
-                StartLevel(--Game.current_level);
-            break;
-        case 'r':
-            KillHero();
-            break;
-        case 'j': // Respawn cheat
-            SetBoard(Game.lastposy, Game.lastposx, HERO);
-            Game.hero_state = FACE1;
-            break;
-        case 't': // Time cheat
-            Game.time = Game.level_time;
-            break;
-        case 'q':
-            exit(0);
+        }
+        atexit(StopTrace); // Before the stats are printed
     }
-    return 0;
-}
-
 
-int main()
-{
-    StartAplication();
+    w = StartAplication();
+    if (w == NULL)
+        return 1;
+    w->kernel = KernelSupported(Kernel);
+    w->verify = Verify;
+    world_seed(w, Seed);
+    if (ProfilePath != NULL)
+    {
+        profile_start(&Profile, w);
+        atexit(DumpProfile);
+    }
 
+    // Keys are handled as they come, between the ticks; the ticks of
+    // the world still come on time
+    ticker_start(&Ticker, INTER_TIME, CatchUp);
+    input_init(&Input, 0);
+    wake[0].events = wake[1].events = POLLIN;
+    wake[1].fd = Spectators.epoll;
+    replay_keyframe(&Recorder, Tick, w);
+    ShowChanges(w, 0);
     while (1)
     {
-        if (KeyDown())
+        // While nothing can happen, sleep to the tick something may
+        // (a key wakes the game before); the ticks slept through are
+        // played on waking, no frame is made for them
+        quiet = Input.first != Input.last || Profile.overlay ? 1 : world_quiet(w);
+        wake[0].fd = Input.fd;
+        due = ticker_wait(&Ticker, wake, 2, quiet);
+
+        // After every tick the moves left waiting get their turn
+        for (; due > 0; due--)
         {
-            ShowView();
-            SoundPlay();
+            uint64_t frame = profile_clock(&Profile);
+
+            RefreashBoard(w);
+            Tick++;
+            Stepped = 0;
+            undo_push(&Undo, Tick, w);
+            replay_keyframe(&Recorder, Tick, w);
+            if (Input.first != Input.last)
+                PlayKeys(w, profile_clock(&Profile));
+            profile_mark(&Profile, PROFILE_FRAME, frame);
         }
 
-        DecrementTime();
-        RefreashBoard();
+        if (wake[0].revents)
+        {
+            uint64_t start = profile_clock(&Profile);
 
-        Sleep(1000 / 60);
+            input_read(&Input); // When closed, the game goes on without keys
+            PlayKeys(w, start);
+        }
+        if (wake[1].revents)
+            broadcast_service(&Spectators);
     }
 }
-
@@ -0,0 +1,415 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Broadcast: the frames of the game, board and status line, sent to any
+ * number of spectators on a Unix socket (boulder-watch shows them).
+ * A frame is encoded once, as the cells changed since the last one, into
+ * a ring all the spectators are sent from, each from where it got to.
+ * The sockets never block: a spectator which can't take more waits for
+ * EPOLLOUT, and one falling BROADCAST_LAG bytes behind gets a keyframe
+ * (the whole frame) after the message it's in instead of the backlog.
+ *
+ * The stream is messages of a kind byte, the length of the rest (two
+ * bytes, low first) and the rest:
+ *   BROADCAST_KEYFRAME: FRAME_HIGH, FRAME_WIDTH, then all the cells row
+ *                       after row; the first message a spectator gets
+ *   BROADCAST_DELTA:    runs of cells: row, column, length, the cells
+ */
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define BROADCAST_RING      65536 // Bytes of messages kept, a power of two
+#define BROADCAST_LAG       (BROADCAST_RING / 2) // Behind more gets a keyframe
+#define BROADCAST_CLIENTS   64
+#define BROADCAST_HEAD      3     // Kind and length
+#define BROADCAST_MESSAGE   (BROADCAST_HEAD + 2 + FRAME_HIGH * FRAME_WIDTH * 4)
+
+enum broadcast_kind {BROADCAST_KEYFRAME = 'K', BROADCAST_DELTA = 'D'};
+
+struct broadcast_stats
+{
+    unsigned long spectators; // Connected, ever
+    unsigned long frames;     // Deltas encoded
+    unsigned long keyframes;
+    unsigned long long bytes; // Put in the ring
+    unsigned long slow;       // Backlogs dropped for a keyframe
+    unsigned long dropped;    // Spectators closed for being stuck
+};
+
+struct spectator
+{
+    int fd;                   // -1 for a free place
+    unsigned long long pos;   // Next byte of the ring to send it
+    unsigned long long next;  // Start of the first message from pos on
+    unsigned long long jump;  // Keyframe to go on from
+    int jumping;              // Sent up to next, then on from jump
+    int blocked;              // Waiting for EPOLLOUT
+};
+
+struct broadcast
+{
+    int fd;                   // Listening socket, -1 when not broadcasting
+    int epoll;                // Of it and the spectators, -1 when none
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const struct renderer *screen; // The frames to send, what's on it
+    char shown[FRAME_HIGH][FRAME_WIDTH]; // The last frame sent
+    unsigned char ring[BROADCAST_RING];
+    unsigned long long head;  // Bytes put in the ring, ever
+    unsigned char message[BROADCAST_MESSAGE];
+    struct spectator client[BROADCAST_CLIENTS];
+    int clients;
+    struct broadcast_stats stats;
+};
+
+
+void broadcast_init(struct broadcast *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->fd = b->epoll = -1;
+}
+
+
+/*************************************************************
+ * Listen on the socket at path for spectators of the frames *
+ * of the screen, -1 on error                                *
+ *************************************************************/
+int broadcast_open(struct broadcast *b, const char *path,
+                   const struct renderer *screen)
+{
+    struct sockaddr_un a;
+    struct epoll_event e;
+    struct stat st;
+    int k;
+
+    broadcast_init(b);
+    if (strlen(path) >= sizeof(a.sun_path))
+        return -1;
+    for (k = 0; k < BROADCAST_CLIENTS; k++)
+        b->client[k].fd = -1;
+
+    // A socket left by a game gone is taken over, any other file is not
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    b->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    b->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (b->fd < 0 || b->epoll < 0 || bind(b->fd, (struct sockaddr*)&a, sizeof(a)) < 0)
+        goto fail;
+    strcpy(b->path, path);
+    e.events = EPOLLIN;
+    e.data.u32 = BROADCAST_CLIENTS; // Past the spectators
+    if (listen(b->fd, 16) < 0 || epoll_ctl(b->epoll, EPOLL_CTL_ADD, b->fd, &e) < 0)
+        goto fail;
+    b->screen = screen;
+    memset(b->shown, ' ', sizeof(b->shown)); // As render_init() leaves it
+    return 0;
+
+fail:
+    if (b->path[0])
+        unlink(b->path);
+    if (b->fd >= 0)
+        close(b->fd);
+    if (b->epoll >= 0)
+        close(b->epoll);
+    broadcast_init(b);
+    return -1;
+}
+
+
+void BroadcastDrop(struct broadcast *b, struct spectator *s)
+{
+    epoll_ctl(b->epoll, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    b->clients--;
+}
+
+
+/*****************************************************
+ * Length of the message starting at pos in the ring *
+ *****************************************************/
+unsigned int BroadcastLength(struct broadcast *b, unsigned long long pos)
+{
+    return BROADCAST_HEAD + b->ring[(pos + 1) % BROADCAST_RING]
+           + (b->ring[(pos + 2) % BROADCAST_RING] << 8);
+}
+
+
+/***************************************************************
+ * Send the spectator what it can take now, up to the head (or *
+ * to the keyframe it jumps to); waits for EPOLLOUT when it    *
+ * can't take it all                                           *
+ ***************************************************************/
+void BroadcastSend(struct broadcast *b, struct spectator *s)
+{
+    struct epoll_event e;
+    struct msghdr m;
+    struct iovec v[2];
+    unsigned long long end;
+    unsigned int at;
+    ssize_t n;
+
+    while (s->fd >= 0)
+    {
+        if (s->jumping && s->pos == s->next)
+        {
+            s->pos = s->next = s->jump;
+            s->jumping = 0;
+        }
+        end = s->jumping ? s->next : b->head;
+        if (s->pos == end)
+            break;
+
+        // The bytes from pos to end, in two pieces when the ring wraps
+        at = s->pos % BROADCAST_RING;
+        v[0].iov_base = b->ring + at;
+        v[0].iov_len = end - s->pos;
+        if (v[0].iov_len > BROADCAST_RING - at)
+            v[0].iov_len = BROADCAST_RING - at;
+        v[1].iov_base = b->ring;
+        v[1].iov_len = end - s->pos - v[0].iov_len;
+        memset(&m, 0, sizeof(m));
+        m.msg_iov = v;
+        m.msg_iovlen = v[1].iov_len ? 2 : 1;
+        n = sendmsg(s->fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN)
+        {
+            BroadcastDrop(b, s); // Gone
+            return;
+        }
+        if (n < 0)
+            break;
+
+        s->pos += n;
+        while (s->next < s->pos)
+            s->next += BroadcastLength(b, s->next);
+    }
+
+    // Wait for room only while there is something to send
+    if (s->fd >= 0 && s->blocked != (s->pos != b->head))
+    {
+        s->blocked ^= 1;
+        e.events = EPOLLIN | (s->blocked ? EPOLLOUT : 0);
+        e.data.u32 = s - b->client;
+        epoll_ctl(b->epoll, EPOLL_CTL_MOD, s->fd, &e);
+    }
+}
+
+
+/*************************************************************
+ * Put the message (its rest composed after the head) in the *
+ * ring, returns where it starts; a spectator whose unsent   *
+ * bytes it would write over is dropped                      *
+ *************************************************************/
+unsigned long long BroadcastPut(struct broadcast *b, int kind, unsigned int n)
+{
+    unsigned long long at = b->head;
+    struct spectator *s;
+    unsigned int k;
+
+    b->message[0] = kind;
+    b->message[1] = n & 0xFF;
+    b->message[2] = n >> 8;
+    n += BROADCAST_HEAD;
+
+    for (s = b->client; s < b->client + BROADCAST_CLIENTS; s++)
+        if (s->fd >= 0 && b->head + n - s->pos > BROADCAST_RING)
+        {
+            BroadcastDrop(b, s);
+            b->stats.dropped++;
+        }
+
+    for (k = 0; k < n; k++)
+        b->ring[(at + k) % BROADCAST_RING] = b->message[k];
+    b->head += n;
+    b->stats.bytes += n;
+    return at;
+}
+
+
+/**************************************************
+ * Put a keyframe of the frame shown in the ring, *
+ * returns where it starts                        *
+ **************************************************/
+unsigned long long BroadcastKeyframe(struct broadcast *b)
+{
+    unsigned char *p = b->message + BROADCAST_HEAD;
+
+    *p++ = FRAME_HIGH;
+    *p++ = FRAME_WIDTH;
+    memcpy(p, b->shown, sizeof(b->shown));
+    b->stats.keyframes++;
+    return BroadcastPut(b, BROADCAST_KEYFRAME, 2 + sizeof(b->shown));
+}
+
+
+/**********************************************************
+ * Take the spectators waiting, each starts at a keyframe *
+ **********************************************************/
+void BroadcastAccept(struct broadcast *b)
+{
+    struct epoll_event e;
+    struct spectator *s;
+    unsigned long long key = 0;
+    int fd, k, taken = 0;
+
+    while ((fd = accept(b->fd, NULL, NULL)) >= 0)
+    {
+        // Plain accept() and fcntl(), accept4() needs _GNU_SOURCE
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        for (k = 0; k < BROADCAST_CLIENTS && b->client[k].fd >= 0; k++)
+            ;
+        e.events = EPOLLIN;
+        e.data.u32 = k;
+        if (k == BROADCAST_CLIENTS || epoll_ctl(b->epoll, EPOLL_CTL_ADD, fd, &e) < 0)
+        {
+            close(fd); // No room
+            continue;
+        }
+        if (!taken++)
+            key = BroadcastKeyframe(b);
+        s = &b->client[k];
+        memset(s, 0, sizeof(*s));
+        s->fd = fd;
+        s->pos = s->next = key;
+        b->clients++;
+        b->stats.spectators++;
+        BroadcastSend(b, s);
+    }
+}
+
+
+/****************************************************************
+ * Handle what the epoll fd has for us: new spectators, room to *
+ * send more and spectators gone; never waits                   *
+ ****************************************************************/
+void broadcast_service(struct broadcast *b)
+{
+    struct epoll_event e[16];
+    struct spectator *s;
+    char junk[256];
+    ssize_t r;
+    int n, k;
+
+    if (b->epoll < 0)
+        return;
+    n = epoll_wait(b->epoll, e, 16, 0);
+    for (k = 0; k < n; k++)
+    {
+        if (e[k].data.u32 == BROADCAST_CLIENTS)
+        {
+            BroadcastAccept(b);
+            continue;
+        }
+        s = &b->client[e[k].data.u32];
+        if (s->fd < 0)
+            continue; // Dropped by an event before
+        if (e[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        {
+            r = read(s->fd, junk, sizeof(junk));
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+            {
+                BroadcastDrop(b, s); // Spectators say nothing, it left
+                continue;
+            }
+        }
+        if (e[k].events & EPOLLOUT)
+            BroadcastSend(b, s);
+    }
+}
+
+
+/**************************************************************
+ * Send the cells of the screen changed since the last frame, *
+ * once for all the spectators                                *
+ **************************************************************/
+void broadcast_frame(struct broadcast *b)
+{
+    unsigned char *p = b->message + BROADCAST_HEAD;
+    const struct renderer *r = b->screen;
+    unsigned long long key = 0;
+    struct spectator *s;
+    int y, x, end, last, slow = 0;
+
+    if (b->clients == 0)
+    {
+        if (b->fd >= 0) // For the next one, starting with a keyframe
+            memcpy(b->shown, r->prev, sizeof(b->shown));
+        return;
+    }
+
+    // Runs of changed cells, over short gaps like on the terminal
+    for (y = 0; y < FRAME_HIGH; y++)
+        for (x = 0; x < FRAME_WIDTH; x = end)
+        {
+            end = x + 1;
+            if (b->shown[y][x] == r->prev[y][x])
+                continue;
+            for (last = x; end < FRAME_WIDTH && end - last <= RENDER_GAP; end++)
+                if (b->shown[y][end] != r->prev[y][end])
+                    last = end;
+            end = last + 1;
+            *p++ = y;
+            *p++ = x;
+            *p++ = end - x;
+            memcpy(p, &r->prev[y][x], end - x);
+            p += end - x;
+        }
+    if (p == b->message + BROADCAST_HEAD)
+        return; // The same frame
+    memcpy(b->shown, r->prev, sizeof(b->shown));
+    BroadcastPut(b, BROADCAST_DELTA, p - b->message - BROADCAST_HEAD);
+    b->stats.frames++;
+
+    // Too far behind: the rest of the message it's in, then a keyframe
+    for (s = b->client; s < b->client + BROADCAST_CLIENTS; s++)
+        if (s->fd >= 0 && !s->jumping && b->head - s->pos > BROADCAST_LAG)
+        {
+            if (!slow++)
+                key = BroadcastKeyframe(b);
+            if (s->pos == s->next)
+                s->pos = s->next = key; // Between two messages, at once
+            else
+            {
+                s->jumping = 1;
+                s->jump = key;
+            }
+            b->stats.slow++;
+        }
+
+    for (s = b->client; s < b->client + BROADCAST_CLIENTS; s++)
+        if (s->fd >= 0 && !s->blocked)
+            BroadcastSend(b, s);
+}
+
+
+/************************************
+ * Stop, the socket file is removed *
+ ************************************/
+void broadcast_close(struct broadcast *b)
+{
+    int k;
+
+    if (b->fd < 0)
+        return;
+    for (k = 0; k < BROADCAST_CLIENTS; k++)
+        if (b->client[k].fd >= 0)
+            close(b->client[k].fd);
+    close(b->fd);
+    close(b->epoll);
+    unlink(b->path);
+    b->fd = b->epoll = -1;
+}
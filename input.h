@@ -0,0 +1,177 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Input: whatever the terminal has is taken with one readv() into a ring
+ * of bytes, and the bytes are parsed into keys. Escape sequences are
+ * parsed whole, CSI (ESC [ parameters final) and SS3 (ESC O final), so
+ * the arrows come as KEY_UP.. and the letters of a sequence are never
+ * taken for keys; other sequences are dropped. A sequence cut by the end
+ * of the read stays in the ring until the rest comes, one too long to be
+ * a key is skipped to its final byte.
+ *
+ * The keys wait in a queue until the game takes them, so a burst of keys
+ * is played one after another and none is lost, unless the queue is full.
+ */
+
+#include <sys/uio.h>
+
+#define INPUT_BYTES         4096 // The ring of bytes, a power of two
+#define INPUT_KEYS          256  // The queue of keys, a power of two
+#define INPUT_SEQUENCE      32   // Bytes of an escape sequence at most
+
+struct input_stats
+{
+    unsigned long reads;
+    unsigned long bytes;
+    unsigned long keys;       // Put in the queue
+    unsigned long dropped;    // Lost to a full queue
+    unsigned long sequences;  // Escape sequences, arrows or not
+};
+
+struct input
+{
+    int fd;                   // -1 once it's closed
+    unsigned char byte[INPUT_BYTES];
+    unsigned int head, tail;  // Bytes read and bytes parsed, ever
+    int key[INPUT_KEYS];
+    unsigned int first, last; // Keys taken and keys queued, ever
+    int skip;                 // In a sequence too long, up to its final byte
+    struct input_stats stats;
+};
+
+
+void input_init(struct input *in, int fd)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+}
+
+
+void InputQueue(struct input *in, int key)
+{
+    if (in->last - in->first == INPUT_KEYS)
+    {
+        in->stats.dropped++;
+        return;
+    }
+    in->key[in->last++ % INPUT_KEYS] = key;
+    in->stats.keys++;
+}
+
+
+/***********************************************************
+ * The byte k places after the first one not parsed, -1 if *
+ * it hasn't come yet                                      *
+ ***********************************************************/
+int InputByte(struct input *in, unsigned int k)
+{
+    return in->tail + k < in->head ? in->byte[(in->tail + k) % INPUT_BYTES] : -1;
+}
+
+
+/*************************************************************
+ * Parse the escape sequence at the tail, returns its length *
+ * (the key, if any, queued) or 0 when it's not all here yet *
+ *************************************************************/
+unsigned int InputSequence(struct input *in)
+{
+    unsigned int k;
+    int c = InputByte(in, 1);
+
+    if (c < 0)
+        return 0;
+    if (c == 'O')         // SS3, one final byte
+        k = 2;
+    else if (c == '[')    // CSI, parameters before the final byte
+    {
+        for (k = 2; (c = InputByte(in, k)) >= 0x20 && c <= 0x3F; k++)
+            if (k == INPUT_SEQUENCE)
+            {
+                in->skip = 1; // Nothing that long is sent, dropped
+                return k;
+            }
+    } else
+        return 1;         // A lone ESC, dropped and the byte after it parsed
+
+    c = InputByte(in, k);
+    if (c < 0)
+        return 0;
+    in->stats.sequences++;
+    if (c >= 'A' && c <= 'D') // Modifiers in the parameters don't matter
+        InputQueue(in, KEY_UP + c - 'A');
+    return k + 1;
+}
+
+
+/***************************************
+ * Parse the bytes read into the queue *
+ ***************************************/
+void InputParse(struct input *in)
+{
+    unsigned int n;
+    int c;
+
+    while ((c = InputByte(in, 0)) >= 0)
+    {
+        n = 1;
+        if (in->skip)
+            in->skip = c >= 0x20 && c <= 0x3F;
+        else if (c != 27)
+            InputQueue(in, c);
+        else if ((n = InputSequence(in)) == 0)
+            break;
+        in->tail += n;
+    }
+}
+
+
+/************************************************************
+ * Read what the fd has, with one call, and queue its keys; *
+ * returns the number of keys queued, or -1 when the fd is  *
+ * closed (then it's set to -1)                             *
+ ************************************************************/
+int input_read(struct input *in)
+{
+    struct iovec v[2];
+    unsigned int at = in->head % INPUT_BYTES;
+    unsigned int room = INPUT_BYTES - (in->head - in->tail);
+    unsigned long keys = in->stats.keys;
+    ssize_t n;
+
+    if (in->fd < 0)
+        return -1;
+
+    // The free part of the ring, in two pieces when it wraps
+    v[0].iov_base = in->byte + at;
+    v[0].iov_len = room < INPUT_BYTES - at ? room : INPUT_BYTES - at;
+    v[1].iov_base = in->byte;
+    v[1].iov_len = room - v[0].iov_len;
+    n = readv(in->fd, v, v[1].iov_len ? 2 : 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+    {
+        in->fd = -1; // Ready to read and nothing came, it's gone
+        return -1;
+    }
+
+    in->stats.reads++;
+    in->stats.bytes += n;
+    in->head += n;
+    InputParse(in);
+    return in->stats.keys - keys;
+}
+
+
+/****************************************
+ * Take the next key, -1 when none came *
+ ****************************************/
+int input_key(struct input *in)
+{
+    if (in->first == in->last)
+        return -1;
+    return in->key[in->first++ % INPUT_KEYS];
+}
@@ -0,0 +1,185 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Rock candidates from the cell bytes. A kernel gets two windows of
+ * KERNEL_WINDOW bytes, the row and the row below, holding the cell left
+ * of the 64 cells wanted, the 64 cells and the cell right of them. It
+ * returns a bit for each of the 64 cells which is a rock or diamond that
+ * falls, rolls, kills or is still moving (see RockCandidates).
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define KERNEL_X86
+#endif
+
+#define KERNEL_WINDOW       80  // 66 bytes used, the rest is for the loads
+
+const char *KernelNames[KERNELS] = {"auto", "planes", "scalar", "sse2", "avx2"};
+
+
+/*******************************************
+ * The reference: one cell after the other *
+ *******************************************/
+uint64_t RockKernelScalar(const unsigned char *a, const unsigned char *b)
+{
+    uint64_t m = 0;
+    int c, here, below, free_left, free_right;
+
+    for (c = 0; c < 64; c++)
+    {
+        here = a[c + 1] & CELL_TILE;
+        below = b[c + 1] & CELL_TILE;
+        if (here != ROCK && here != DIAMOND)
+            continue;
+
+        free_left = (a[c] & CELL_TILE) == TUNNEL
+                    && (b[c] & CELL_TILE) == TUNNEL;
+        free_right = (a[c + 2] & CELL_TILE) == TUNNEL
+                     && (b[c + 2] & CELL_TILE) == TUNNEL;
+
+        if (below == TUNNEL || below == BOX || below == FLY
+            || (a[c + 1] & CELL_ROCK_MOVE)
+            || ((below == ROCK || below == DIAMOND || below == WALL
+                 || below == DOOR || below == METAL)
+                && (free_left || free_right)))
+            m |= 1ULL << c;
+    }
+    return m;
+}
+
+
+#ifdef KERNEL_X86
+/***************************************
+ * 16 cells at once, any x86-64 has it *
+ ***************************************/
+__attribute__((target("sse2")))
+uint64_t RockKernelSSE2(const unsigned char *a, const unsigned char *b)
+{
+    const __m128i tile = _mm_set1_epi8(CELL_TILE);
+    const __m128i move = _mm_set1_epi8(CELL_ROCK_MOVE);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i here, below, left, right, rock, support, go;
+    uint64_t m = 0;
+    int c;
+
+#define T(p)        _mm_and_si128(_mm_loadu_si128((const __m128i*)(p)), tile)
+#define IS(v, t)    _mm_cmpeq_epi8(v, _mm_set1_epi8(t))
+
+    for (c = 0; c < 64; c += 16)
+    {
+        here = T(a + c + 1);
+        below = T(b + c + 1);
+        left = _mm_and_si128(_mm_cmpeq_epi8(T(a + c), zero),
+                             _mm_cmpeq_epi8(T(b + c), zero));
+        right = _mm_and_si128(_mm_cmpeq_epi8(T(a + c + 2), zero),
+                              _mm_cmpeq_epi8(T(b + c + 2), zero));
+
+        rock = _mm_or_si128(IS(here, ROCK), IS(here, DIAMOND));
+        support = _mm_or_si128(_mm_or_si128(IS(below, ROCK), IS(below, DIAMOND)),
+                  _mm_or_si128(_mm_or_si128(IS(below, WALL), IS(below, DOOR)),
+                               IS(below, METAL)));
+
+        go = _mm_or_si128(_mm_or_si128(IS(below, TUNNEL), IS(below, BOX)),
+                          IS(below, FLY));
+        go = _mm_or_si128(go, _mm_cmpeq_epi8(_mm_and_si128(
+                 _mm_loadu_si128((const __m128i*)(a + c + 1)), move), move));
+        go = _mm_or_si128(go, _mm_and_si128(support, _mm_or_si128(left, right)));
+
+        m |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_and_si128(rock, go)) << c;
+    }
+
+#undef T
+#undef IS
+    return m;
+}
+
+
+/*******************************************************
+ * 32 cells at once, tile classes from a shuffle table *
+ *******************************************************/
+__attribute__((target("avx2")))
+uint64_t RockKernelAVX2(const unsigned char *a, const unsigned char *b)
+{
+    const __m256i tile = _mm256_set1_epi8(CELL_TILE);
+    const __m256i move = _mm256_set1_epi8(CELL_ROCK_MOVE);
+    const __m256i classes = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)TilePlanes));
+    __m256i here, below, left, right, go;
+    uint64_t m = 0;
+    int c;
+
+// Planes of the tiles (TilePlanes), and the test for one of them
+#define P(p)        _mm256_shuffle_epi8(classes, _mm256_and_si256( \
+                        _mm256_loadu_si256((const __m256i*)(p)), tile))
+#define HAS(v, p)   _mm256_cmpeq_epi8(_mm256_and_si256(v, \
+                        _mm256_set1_epi8(1 << (p))), _mm256_set1_epi8(1 << (p)))
+
+    for (c = 0; c < 64; c += 32)
+    {
+        here = P(a + c + 1);
+        below = P(b + c + 1);
+        left = _mm256_and_si256(P(a + c), P(b + c));
+        right = _mm256_and_si256(P(a + c + 2), P(b + c + 2));
+
+        go = _mm256_or_si256(HAS(below, PLANE_TUNNEL), HAS(below, PLANE_ENEMY));
+        go = _mm256_or_si256(go, _mm256_cmpeq_epi8(_mm256_and_si256(
+                 _mm256_loadu_si256((const __m256i*)(a + c + 1)), move), move));
+        go = _mm256_or_si256(go, _mm256_and_si256(HAS(below, PLANE_SUPPORT),
+                 HAS(_mm256_or_si256(left, right), PLANE_TUNNEL)));
+
+        m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                 _mm256_and_si256(HAS(here, PLANE_ROCK), go)) << c;
+    }
+
+#undef P
+#undef HAS
+    return m;
+}
+#endif
+
+
+/********************************************
+ * Kernel the CPU can run, -1 when it can't *
+ ********************************************/
+int KernelSupported(int kernel)
+{
+    switch (kernel)
+    {
+        case KERNEL_AUTO:
+            // The byte kernels copy the rows into windows first, which
+            // costs more than they save over the bitplanes
+            return KERNEL_PLANES;
+        case KERNEL_PLANES:
+        case KERNEL_SCALAR:
+            return kernel;
+#ifdef KERNEL_X86
+        case KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2") ? kernel : -1;
+        case KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2") ? kernel : -1;
+#endif
+    }
+    return -1;
+}
+
+
+/******************************************
+ * Run the byte kernel on the two windows *
+ ******************************************/
+uint64_t RockKernel(int kernel, const unsigned char *a, const unsigned char *b)
+{
+    switch (kernel)
+    {
+#ifdef KERNEL_X86
+        case KERNEL_SSE2:
+            return RockKernelSSE2(a, b);
+        case KERNEL_AVX2:
+            return RockKernelAVX2(a, b);
+#endif
+    }
+    return RockKernelScalar(a, b);
+}
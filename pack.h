@@ -0,0 +1,180 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Level pack file, the numbers are little endian:
+ *
+ *   "BPK1", u32 number of levels
+ *   for every level: u32 offset of the cells from the start of the file,
+ *                    u16 width, u16 height, u16 diamonds, u16 time
+ *   the cells of every level, row after row, two cells a byte with the
+ *   first one in the low four bits
+ *
+ * The file is mapped and a level is decoded only when it is entered.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACK_MAGIC          "BPK1"
+#define PACK_HEADER         8   // Magic and the number of levels
+#define PACK_ENTRY          12  // Bytes of a level in the header
+
+
+unsigned PackGet(const unsigned char *p, int n)
+{
+    unsigned v = 0;
+
+    while (n--)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+
+void PackPut(unsigned char *p, unsigned v, int n)
+{
+    while (n--)
+    {
+        *p++ = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+
+/*********************************************************
+ * Map the level pack, NULL if it isn't one or is broken *
+ *********************************************************/
+struct level *world_open_pack(const char *path, int *count)
+{
+    struct level *l = NULL;
+    const unsigned char *map, *e;
+    struct stat st;
+    unsigned n, k, offset;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < PACK_HEADER)
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays
+    if (map == MAP_FAILED)
+        return NULL;
+
+    n = PackGet(map + 4, 4);
+    if (memcmp(map, PACK_MAGIC, 4) || n == 0
+        || n > (st.st_size - PACK_HEADER) / PACK_ENTRY
+        || (l = calloc(n, sizeof(struct level))) == NULL)
+        goto fail;
+
+    for (k = 0; k < n; k++)
+    {
+        e = map + PACK_HEADER + k * PACK_ENTRY;
+        offset = PackGet(e, 4);
+        l[k].width = PackGet(e + 4, 2);
+        l[k].height = PackGet(e + 6, 2);
+        l[k].diamonds = PackGet(e + 8, 2);
+        l[k].time = PackGet(e + 10, 2);
+        l[k].packed = map + offset;
+
+        if (l[k].width < 3 || l[k].height < 3
+            || l[k].width > LEVEL_MAX || l[k].height > LEVEL_MAX
+            || offset > st.st_size
+            || ((long long)l[k].width * l[k].height + 1) / 2 > st.st_size - offset)
+            goto fail;
+    }
+
+    *count = n;
+    return l;
+
+fail:
+    free(l);
+    munmap((void*)map, st.st_size);
+    return NULL;
+}
+
+
+/****************************************************************
+ * The levels fit in the numbers of a pack: 16 bits of the size *
+ * and the counts, 32 bits of the offsets of the cells          *
+ ****************************************************************/
+int PackFits(const struct level *l, int count)
+{
+    long long offset = PACK_HEADER + (long long)count * PACK_ENTRY;
+    int k;
+
+    for (k = 0; k < count; k++)
+    {
+        if ((unsigned)l[k].width > 0xFFFF || (unsigned)l[k].height > 0xFFFF
+            || (unsigned)l[k].diamonds > 0xFFFF || (unsigned)l[k].time > 0xFFFF)
+            return 0;
+        offset += ((long long)l[k].width * l[k].height + 1) / 2;
+        if (offset > 0xFFFFFFFFLL)
+            return 0;
+    }
+    return count >= 0;
+}
+
+
+/**************************************************************
+ * Write the levels as a pack, -1 on error or when they don't *
+ * fit in it                                                  *
+ **************************************************************/
+int world_write_pack(const char *path, const struct level *l, int count)
+{
+    FILE *f;
+    unsigned char head[PACK_ENTRY], *row;
+    unsigned offset = PACK_HEADER + count * PACK_ENTRY;
+    long long c, cells;
+    int k, err = 0;
+
+    if (!PackFits(l, count))
+        return -1;
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+
+    memcpy(head, PACK_MAGIC, 4);
+    PackPut(head + 4, count, 4);
+    fwrite(head, 1, PACK_HEADER, f);
+    for (k = 0; k < count; k++)
+    {
+        PackPut(head, offset, 4);
+        PackPut(head + 4, l[k].width, 2);
+        PackPut(head + 6, l[k].height, 2);
+        PackPut(head + 8, l[k].diamonds, 2);
+        PackPut(head + 10, l[k].time, 2);
+        fwrite(head, 1, PACK_ENTRY, f);
+        offset += ((long long)l[k].width * l[k].height + 1) / 2;
+    }
+
+    for (k = 0; k < count; k++)
+    {
+        cells = (long long)l[k].width * l[k].height;
+        row = calloc((cells + 1) / 2, 1);
+        if (row == NULL)
+        {
+            err = 1;
+            break;
+        }
+        for (c = 0; c < cells; c++)
+            row[c / 2] |= LevelTile(&l[k], c / l[k].width, c % l[k].width)
+                          << (c % 2 * 4);
+        fwrite(row, 1, (cells + 1) / 2, f);
+        free(row);
+    }
+
+    if (ferror(f))
+        err = 1;
+    if (fclose(f) != 0)
+        err = 1;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Frame profiler: the time of every phase of a frame, from the
+ * monotonic clock, into two histograms of the phase: one of the whole
+ * game and one of the last PROFILE_WINDOW samples (a sample leaving the
+ * window is taken out of it again). Buckets go up by a quarter of a
+ * power of two, so a percentile is off by less than that.
+ *
+ * Nothing is timed until the profiler is started; then the overlay
+ * shows the window over the board and the whole game can be written
+ * out as JSON at exit.
+ */
+
+#define PROFILE_WINDOW      1024 // Samples of a phase the overlay is about
+#define PROFILE_SUB         4    // Buckets a power of two
+#define PROFILE_BUCKETS     (40 * PROFILE_SUB) // Up to 2^40 ns, 18 minutes
+
+enum profile_phase {PROFILE_INPUT,  // Reading and handling a key
+                    PROFILE_CRASH,  // The phases of world_step()
+                    PROFILE_ROCKS,
+                    PROFILE_BOXES,
+                    PROFILE_STATUS, // Composing the status line
+                    PROFILE_VIEW,   // Composing the view
+                    PROFILE_FLUSH,  // Turning the changed cells into bytes
+                    PROFILE_WRITE,  // Writing them to the terminal
+                    PROFILE_SOUND,
+                    PROFILE_FRAME,  // All of a tick but the sleep
+                    PROFILE_PHASES};
+
+const char *ProfileNames[PROFILE_PHASES] = {"input", "crash", "rocks", "boxes",
+    "status", "view", "flush", "write", "sound", "frame"};
+
+struct histogram
+{
+    unsigned long count[PROFILE_BUCKETS];
+    unsigned long n;
+    unsigned long long total; // Nanoseconds of all the samples
+    uint64_t max;
+};
+
+struct profile_samples
+{
+    struct histogram all;
+    struct histogram window;
+    uint64_t ring[PROFILE_WINDOW]; // The window, oldest at head once full
+    int head;
+};
+
+struct profile
+{
+    int on;
+    int overlay;
+    uint64_t world_ns[PHASES]; // world_step() adds its phases here
+    struct profile_samples phase[PROFILE_PHASES];
+};
+
+
+uint64_t ProfileNow(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/*************************************
+ * Bucket of the time in nanoseconds *
+ *************************************/
+int ProfileBucket(uint64_t ns)
+{
+    int e;
+
+    if (ns < PROFILE_SUB)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    if (e >= PROFILE_BUCKETS / PROFILE_SUB + 1)
+        return PROFILE_BUCKETS - 1;
+    return (e - 1) * PROFILE_SUB + ((ns >> (e - 2)) & (PROFILE_SUB - 1));
+}
+
+
+/*****************************************
+ * The longest time that fits the bucket *
+ *****************************************/
+uint64_t ProfileTop(int b)
+{
+    int e = b / PROFILE_SUB + 1;
+
+    if (b < PROFILE_SUB)
+        return b;
+    return ((uint64_t)(PROFILE_SUB + b % PROFILE_SUB + 1) << (e - 2)) - 1;
+}
+
+
+/*****************************************************
+ * Time under which the fraction q of the samples is *
+ *****************************************************/
+uint64_t ProfilePercentile(const struct histogram *h, double q)
+{
+    unsigned long seen = 0;
+    int b;
+
+    for (b = 0; b < PROFILE_BUCKETS; b++)
+    {
+        seen += h->count[b];
+        if (seen > 0 && seen >= q * h->n)
+            return ProfileTop(b) < h->max ? ProfileTop(b) : h->max;
+    }
+    return h->max;
+}
+
+
+/***********************************************************
+ * The time now to start timing from, 0 when not profiling *
+ ***********************************************************/
+uint64_t profile_clock(struct profile *p)
+{
+    return p->on ? ProfileNow() : 0;
+}
+
+
+void profile_add(struct profile *p, int phase, uint64_t ns)
+{
+    struct profile_samples *s = &p->phase[phase];
+    struct histogram *w = &s->window;
+    uint64_t old;
+    int k;
+
+    if (!p->on)
+        return;
+
+    s->all.count[ProfileBucket(ns)]++;
+    s->all.n++;
+    s->all.total += ns;
+    if (ns > s->all.max)
+        s->all.max = ns;
+
+    // The oldest sample leaves the window
+    if (w->n == PROFILE_WINDOW)
+    {
+        old = s->ring[s->head];
+        w->count[ProfileBucket(old)]--;
+        w->n--;
+        w->total -= old;
+        if (old == w->max)
+            for (w->max = 0, k = 0; k < PROFILE_WINDOW; k++)
+                if (k != s->head && s->ring[k] > w->max)
+                    w->max = s->ring[k];
+    }
+    s->ring[s->head] = ns;
+    s->head = (s->head + 1) % PROFILE_WINDOW;
+    w->count[ProfileBucket(ns)]++;
+    w->n++;
+    w->total += ns;
+    if (ns > w->max)
+        w->max = ns;
+}
+
+
+/************************************************************
+ * Add the time since "from" to the phase, returns the time *
+ * now for the next phase                                   *
+ ************************************************************/
+uint64_t profile_mark(struct profile *p, int phase, uint64_t from)
+{
+    uint64_t now;
+
+    if (!p->on)
+        return 0;
+    now = ProfileNow();
+    profile_add(p, phase, now - from);
+    return now;
+}
+
+
+/*************************************************************
+ * Take the phases of the objects' move, when world_step has *
+ * just made one (the events say WORLD_REFRESH)              *
+ *************************************************************/
+void profile_world(struct profile *p, int events)
+{
+    if (!p->on || !(events & WORLD_REFRESH))
+        return;
+    profile_add(p, PROFILE_CRASH, p->world_ns[PHASE_CRASH]);
+    profile_add(p, PROFILE_ROCKS, p->world_ns[PHASE_ROCKS]);
+    profile_add(p, PROFILE_BOXES, p->world_ns[PHASE_BOXES]);
+    memset(p->world_ns, 0, sizeof(p->world_ns));
+}
+
+
+/*******************************************************
+ * Start timing the world and the frames, when not yet *
+ *******************************************************/
+void profile_start(struct profile *p, struct world *w)
+{
+    p->on = 1;
+    w->phase_ns = p->world_ns;
+}
+
+
+/**********************************************************
+ * Put the window of every phase over the top of the view *
+ **********************************************************/
+void profile_overlay(struct profile *p, struct renderer *r)
+{
+    struct histogram *h;
+    char txt[FRAME_WIDTH + 1];
+    int k;
+
+    render_text(r, 0, "phase   p50 us  p99 us  max us   count");
+    for (k = 0; k < PROFILE_PHASES && k + 1 < BOARD_HIGH; k++)
+    {
+        h = &p->phase[k].window;
+        snprintf(txt, sizeof(txt), "%-6s %7.1f %7.1f %7.1f %7lu", ProfileNames[k],
+            ProfilePercentile(h, 0.5) / 1e3, ProfilePercentile(h, 0.99) / 1e3,
+            h->max / 1e3, p->phase[k].all.n);
+        render_text(r, k + 1, txt);
+    }
+}
+
+
+/**********************************************************
+ * Write the whole game's histograms as JSON, -1 on error *
+ **********************************************************/
+int profile_dump(struct profile *p, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    struct histogram *h;
+    int k, b, first;
+
+    if (f == NULL)
+        return -1;
+
+    fprintf(f, "{\n  \"window\": %d,\n  \"phases\": {", PROFILE_WINDOW);
+    for (k = 0; k < PROFILE_PHASES; k++)
+    {
+        h = &p->phase[k].all;
+        fprintf(f, "%s\n    \"%s\": {\"count\": %lu, \"total_ns\": %llu, "
+            "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu,\n"
+            "      \"buckets\": [", k ? "," : "", ProfileNames[k], h->n, h->total,
+            (unsigned long long)ProfilePercentile(h, 0.5),
+            (unsigned long long)ProfilePercentile(h, 0.99),
+            (unsigned long long)h->max);
+
+        // Only the buckets with samples, as [longest ns, count]
+        for (first = 1, b = 0; b < PROFILE_BUCKETS; b++)
+            if (h->count[b])
+            {
+                fprintf(f, "%s[%llu, %lu]", first ? "" : ", ",
+                    (unsigned long long)ProfileTop(b), h->count[b]);
+                first = 0;
+            }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  }\n}\n");
+
+    if (ferror(f))
+    {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) != 0 ? -1 : 0;
+}
@@ -0,0 +1,778 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCREEN_SIZE_X       40
+#define SCREEN_SIZE_Y       22
+
+#define X_MARGIN            0
+#define Y_MARGIN            0
+
+#define TILE_SIZE           1
+#define BITMAP_MAX          14  // Number of bitmaps to load
+
+// The view on the board, levels of any size scroll under it
+#define BOARD_WIDTH         (SCREEN_SIZE_X / TILE_SIZE)
+#define BOARD_HIGH          (SCREEN_SIZE_Y / TILE_SIZE)
+
+#define FRAME_HIGH          (BOARD_HIGH + 1)   // Board and the status line
+#define FRAME_WIDTH         SCREEN_SIZE_X
+#define STATUS_ROW          BOARD_HIGH
+
+// Unchanged cells shorter than a cursor move are sent again instead
+#define RENDER_GAP          6
+// Cells of the frame from here on are tiles (TILES of them), the
+// ones below are text
+#define RENDER_TILE         0x80
+#define RENDER_GLYPH        4   // Bytes of a glyph at most, UTF-8
+#define RENDER_SGR          16  // Bytes changing the attributes at most
+#define RENDER_ATTRS        16  // Different attributes of a theme at most
+#define RENDER_CELL         (RENDER_GLYPH + RENDER_SGR)
+// Bytes of terminal output one frame can take (a full redraw fits)
+#define RENDER_BUFFER       (FRAME_HIGH * (FRAME_WIDTH * RENDER_CELL + 16))
+// Bytes of the sequences shifting the board at most
+#define RENDER_SHIFT        (BOARD_HIGH * 32 + 64)
+// Milliseconds the terminal has to answer the probe
+#define RENDER_PROBE        300
+
+/*
+ * How the terminal can shift the board when the view scrolls, so only
+ * the cells coming in are sent:
+ *   RENDER_SCROLL_NONE:    it can't, or it isn't known, cells are sent
+ *   RENDER_SCROLL_ROWS:    rows in a scroll region (DECSTBM, IL/DL),
+ *                          columns row by row (ICH/DCH)
+ *   RENDER_SCROLL_MARGINS: also left/right margins (DECLRMM), columns
+ *                          of the whole board at once (DECIC/DECDC)
+ */
+enum render_scroll {RENDER_SCROLL_NONE, RENDER_SCROLL_ROWS, RENDER_SCROLL_MARGINS};
+
+/*
+ * A theme: the glyph (UTF-8, one column wide) and the SGR parameters of
+ * every tile (bold and the colors: 1, 30 to 37, 40 to 47 and the bright
+ * ones); tiles left out are shown as the hero, "" is the default
+ * rendition. Text is always shown as it is, in the default rendition.
+ * (world.h, with the tiles, is included before this file)
+ */
+struct render_theme
+{
+    const char *name;
+    const char *glyph[TILES];
+    const char *sgr[TILES];
+};
+
+const struct render_theme RenderThemes[] =
+{
+    {
+        "plain",
+        {[TUNNEL] = " ", [WALL] = "=", [HERO] = "R", [ROCK] = "o",
+         [DIAMOND] = "*", [GROUND] = "~", [METAL] = "#", [BOX] = "@",
+         [DOOR] = ">", [FLY] = "%", [CRASH] = "^"},
+        {[TUNNEL] = ""}
+    },
+    {
+        "color",
+        {[TUNNEL] = " ", [WALL] = "=", [HERO] = "R", [ROCK] = "o",
+         [DIAMOND] = "*", [GROUND] = "~", [METAL] = "#", [BOX] = "@",
+         [DOOR] = ">", [FLY] = "%", [CRASH] = "^"},
+        {[TUNNEL] = "", [WALL] = "31", [HERO] = "1;33", [ROCK] = "37",
+         [DIAMOND] = "1;36", [GROUND] = "33", [METAL] = "1;37",
+         [BOX] = "35", [DOOR] = "1;32", [FLY] = "1;35", [CRASH] = "1;31"}
+    },
+    {
+        "unicode",
+        {[TUNNEL] = " ", [WALL] = "\u2592", [HERO] = "\u263b",
+         [ROCK] = "\u25cf", [DIAMOND] = "\u25c6", [GROUND] = "\u2591",
+         [METAL] = "\u2588", [BOX] = "\u25a0", [DOOR] = "\u25b6",
+         [FLY] = "\u00a4", [CRASH] = "\u2738"},
+        {[TUNNEL] = "", [WALL] = "31", [HERO] = "1;33", [ROCK] = "37",
+         [DIAMOND] = "1;36", [GROUND] = "33", [METAL] = "1;37",
+         [BOX] = "35", [DOOR] = "1;32", [FLY] = "1;35", [CRASH] = "1;31"}
+    },
+};
+
+// Attributes as SGR parameters, 0 for the default
+struct render_attr
+{
+    unsigned char bold;       // 1 or 0
+    unsigned char fg;
+    unsigned char bg;
+};
+
+// The bytes sending a cell, prepared from the theme
+struct render_glyph
+{
+    unsigned char attr;       // The attributes it is shown in, of attr_of
+    unsigned char blank;      // Looks the same in any attributes but a background
+    unsigned char len;
+    char bytes[RENDER_GLYPH];
+};
+
+struct render_stats
+{
+    unsigned long frames;         // Frames sent to terminal
+    unsigned long long bytes;     // Bytes of all frames
+    unsigned long bytes_max;      // The biggest frame
+    unsigned long long ns;        // Time spent composing and writing
+    unsigned long ns_max;         // The slowest frame
+    unsigned long shifts;         // Frames the terminal shifted the board of
+    unsigned long attrs;          // SGR sequences sent
+};
+
+/*
+ * The frame keeps what is on the terminal (prev) and what should be
+ * there (next). Only the cells which differ are sent on flush. When the
+ * board in next is the one in prev scrolled, the terminal is made to
+ * shift it first, if it can and it takes fewer bytes.
+ */
+struct renderer
+{
+    char prev[FRAME_HIGH][FRAME_WIDTH];
+    char next[FRAME_HIGH][FRAME_WIDTH];
+    int full;             // Terminal content unknown, send everything
+    int fd;               // Where frames go, -1 keeps them in memory
+    int scroll;           // enum render_scroll
+    int view, view_y, view_x; // A board is in next, its cell at the top left
+    int shown, shown_y, shown_x; // The same of prev
+    struct render_glyph glyph[256]; // Of every cell value
+    struct render_attr attr_of[RENDER_ATTRS]; // Of the theme, 0 the default
+    int attrs;
+    // Changing from an attribute (or from any, attrs) to another
+    char sgr[RENDER_ATTRS + 1][RENDER_ATTRS][RENDER_SGR];
+    unsigned char sgr_len[RENDER_ATTRS + 1][RENDER_ATTRS];
+    int attr;             // Set on the terminal, -1 unknown
+    char out[RENDER_BUFFER];
+    int len;              // Bytes waiting in out
+    unsigned long bytes;  // Bytes of the frame being composed
+    unsigned long write_ns; // Of the last frame, spent in write()
+    struct render_stats stats;
+};
+
+
+/**********************************************
+ * Forget the terminal, next flush redraws it *
+ **********************************************/
+void render_invalidate(struct renderer *r)
+{
+    r->full = 1;
+    r->attr = -1;
+}
+
+
+/*****************************************************
+ * The attribute with the SGR parameters, added when *
+ * it's a new one                                    *
+ *****************************************************/
+int RenderAttr(struct renderer *r, const char *sgr)
+{
+    struct render_attr a = {0, 0, 0};
+    int k, v;
+
+    while (sgr != NULL && *sgr)
+    {
+        v = atoi(sgr);
+        if (v == 1)
+            a.bold = 1;
+        else if ((v >= 30 && v <= 37) || (v >= 90 && v <= 97))
+            a.fg = v;
+        else if ((v >= 40 && v <= 47) || (v >= 100 && v <= 107))
+            a.bg = v;
+        sgr = strchr(sgr, ';');
+        sgr = sgr != NULL ? sgr + 1 : NULL;
+    }
+
+    for (k = 0; k < r->attrs; k++)
+        if (!memcmp(&r->attr_of[k], &a, sizeof(a)))
+            return k;
+    if (r->attrs == RENDER_ATTRS)
+        return 0; // Too much for a theme, shown plain
+    r->attr_of[r->attrs] = a;
+    return r->attrs++;
+}
+
+
+/****************************************************************
+ * Compose the shortest SGR sequence changing the attributes    *
+ * from "from" (NULL when not known) to "to": the ones which    *
+ * differ, or a reset and all of "to" when it's shorter or bold *
+ * has to go                                                    *
+ ****************************************************************/
+int RenderSgr(const struct render_attr *from, const struct render_attr *to,
+              char *txt)
+{
+    char delta[RENDER_SGR];
+    int n = 0, d = 0;
+
+    n += sprintf(txt + n, "\033[0");
+    if (to->bold)
+        n += sprintf(txt + n, ";1");
+    if (to->fg)
+        n += sprintf(txt + n, ";%d", to->fg);
+    if (to->bg)
+        n += sprintf(txt + n, ";%d", to->bg);
+    txt[n++] = 'm';
+    if (from == NULL || (from->bold && !to->bold))
+        return n;
+
+    d += sprintf(delta + d, "\033[");
+    if (to->bold && !from->bold)
+        d += sprintf(delta + d, "1;");
+    if (to->fg != from->fg)
+        d += sprintf(delta + d, "%d;", to->fg ? to->fg : 39);
+    if (to->bg != from->bg)
+        d += sprintf(delta + d, "%d;", to->bg ? to->bg : 49);
+    delta[d - 1] = 'm';
+    if (d >= n)
+        return n;
+    memcpy(txt, delta, d);
+    return d;
+}
+
+
+/**********************************************
+ * The theme with the name, NULL when none is *
+ **********************************************/
+const struct render_theme *render_find_theme(const char *name)
+{
+    int k;
+
+    for (k = 0; k < (int)(sizeof(RenderThemes) / sizeof(*RenderThemes)); k++)
+        if (!strcmp(name, RenderThemes[k].name))
+            return &RenderThemes[k];
+    return NULL;
+}
+
+
+/************************************************
+ * Prepare the bytes of every cell value for    *
+ * the theme (the attributes are numbered anew) *
+ ************************************************/
+void RenderTheme(struct renderer *r, const struct render_theme *t)
+{
+    struct render_glyph *g;
+    const char *glyph, *sgr;
+    int k, n, from, to;
+
+    r->attrs = 0;
+    RenderAttr(r, ""); // The default is attribute 0
+    for (k = 0; k < 256; k++)
+    {
+        g = &r->glyph[k];
+        g->attr = 0;
+        g->blank = k == ' ';
+        g->len = 1;
+        g->bytes[0] = k < RENDER_TILE ? k : '?';
+    }
+    for (k = 0; k < TILES; k++)
+    {
+        glyph = t->glyph[k] != NULL ? t->glyph[k] : t->glyph[HERO];
+        sgr = t->glyph[k] != NULL ? t->sgr[k] : t->sgr[HERO];
+        n = strlen(glyph);
+        g = &r->glyph[RENDER_TILE + k];
+        g->attr = RenderAttr(r, sgr);
+        g->len = n < RENDER_GLYPH ? n : RENDER_GLYPH;
+        memcpy(g->bytes, glyph, g->len);
+        g->blank = !strcmp(glyph, " ") && !r->attr_of[g->attr].bg;
+    }
+    for (from = 0; from <= r->attrs; from++)
+        for (to = 0; to < r->attrs; to++)
+            r->sgr_len[from][to] = RenderSgr(from < r->attrs ? &r->attr_of[from] : NULL,
+                                             &r->attr_of[to], r->sgr[from][to]);
+}
+
+
+/*********************************************
+ * Start with a cleared terminal (all blank) *
+ * shown in the theme                        *
+ *********************************************/
+void render_init(struct renderer *r, const struct render_theme *theme)
+{
+    memset(r->prev, ' ', sizeof(r->prev));
+    memset(r->next, ' ', sizeof(r->next));
+    memset(&r->stats, 0, sizeof(r->stats));
+    RenderTheme(r, theme);
+    r->full = 0;
+    r->fd = 1;
+    r->scroll = RENDER_SCROLL_NONE;
+    r->view = r->shown = 0;
+    r->attr = 0; // The terminal is just cleared
+    r->len = 0;
+    r->bytes = 0;
+
+    // Anything written by stdio must reach terminal before our frames
+    fflush(stdout);
+}
+
+
+/***********************************
+ * Put the text line, blank padded *
+ ***********************************/
+void render_text(struct renderer *r, int y, const char *txt)
+{
+    int x;
+
+    for (x = 0; x < FRAME_WIDTH && txt[x] && txt[x] != '\n'; x++)
+        r->next[y][x] = txt[x];
+    for (; x < FRAME_WIDTH; x++)
+        r->next[y][x] = ' ';
+}
+
+
+/**************************************
+ * Write the composed frame in one go *
+ **************************************/
+void render_write(struct renderer *r)
+{
+    struct timespec t0, t1;
+    char *p = r->out;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (r->fd >= 0 && r->len > 0)
+    {
+        n = write(r->fd, p, r->len);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break; // Terminal is gone, nothing to do
+        }
+        p += n;
+        r->len -= n;
+    }
+    r->len = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->write_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+}
+
+
+/**********************************
+ * Append bytes to composed frame *
+ **********************************/
+void render_put(struct renderer *r, const char *data, int n)
+{
+    if (r->len + n > RENDER_BUFFER)
+        render_write(r); // Only a frame bigger than the buffer gets here
+
+    memcpy(r->out + r->len, data, n);
+    r->len += n;
+    r->bytes += n;
+}
+
+
+/********************************
+ * Append the number in decimal *
+ ********************************/
+int render_number(char *txt, int v)
+{
+    int n = 0, d;
+
+    for (d = 1; d * 10 <= v; d *= 10);
+    for (; d; d /= 10)
+        txt[n++] = '0' + v / d % 10;
+    return n;
+}
+
+
+/************************************************************
+ * Compose ESC [ a ; b and the final bytes, a or b left out *
+ * when -1                                                  *
+ ************************************************************/
+int RenderCsi(char *txt, int a, int b, const char *final)
+{
+    int n = 0;
+
+    txt[n++] = '\033';
+    txt[n++] = '[';
+    if (a >= 0)
+        n += render_number(txt + n, a);
+    if (b >= 0)
+    {
+        txt[n++] = ';';
+        n += render_number(txt + n, b);
+    }
+    while (*final)
+        txt[n++] = *final++;
+    return n;
+}
+
+
+/*********************************************
+ * Append the cursor move to (y, x), 0 based *
+ *********************************************/
+void render_goto(struct renderer *r, int y, int x)
+{
+    char txt[24];
+
+    render_put(r, txt, RenderCsi(txt, y + 1, x + 1, "H"));
+}
+
+
+/****************************************************************
+ * The bytes of the last frame sent, NULL when it didn't fit in *
+ * the buffer and went out in pieces                            *
+ ****************************************************************/
+const char *render_frame(struct renderer *r, int *n)
+{
+    *n = r->bytes;
+    return r->bytes <= RENDER_BUFFER ? r->out : NULL;
+}
+
+
+// The attributes set on the terminal are known and have no background
+int RenderNoBackground(struct renderer *r)
+{
+    return r->attr >= 0 && !r->attr_of[r->attr].bg;
+}
+
+
+// The cells look the same on the terminal
+int RenderSame(struct renderer *r, char a, char b)
+{
+    return a == b || (r->glyph[(unsigned char)a].blank && r->glyph[(unsigned char)b].blank);
+}
+
+
+/************************************************************
+ * Append the cells of row y from x to end, an SGR sequence *
+ * only where the attributes change from the cell before    *
+ ************************************************************/
+void RenderCells(struct renderer *r, int y, int x, int end)
+{
+    const struct render_glyph *g;
+    char *p;
+    int from;
+
+    if (r->len + (end - x) * RENDER_CELL > RENDER_BUFFER)
+        render_write(r);
+
+    p = r->out + r->len;
+    for (; x < end; x++)
+    {
+        g = &r->glyph[(unsigned char)r->next[y][x]];
+        if (g->attr != r->attr && !(g->blank && RenderNoBackground(r)))
+        {
+            from = r->attr >= 0 ? r->attr : r->attrs;
+            memcpy(p, r->sgr[from][g->attr], r->sgr_len[from][g->attr]);
+            p += r->sgr_len[from][g->attr];
+            r->attr = g->attr;
+            r->stats.attrs++;
+        }
+        memcpy(p, g->bytes, g->len);
+        p += g->len;
+    }
+    r->bytes += p - (r->out + r->len);
+    r->len = p - r->out;
+}
+
+
+/**************************************************************
+ * Look for the answers to the probe in the len bytes read: 1 *
+ * when DA1 came, and *margins set when DECRQM says the       *
+ * left/right margins (mode 69) are there                     *
+ **************************************************************/
+int RenderProbeAnswers(const char *txt, int len, int *margins)
+{
+    int attached = 0, param[2], n, k, j;
+
+    for (k = 0; k + 2 < len; k++)
+    {
+        if (txt[k] != '\033' || txt[k + 1] != '[' || txt[k + 2] != '?')
+            continue;
+
+        // ESC [ ? parameters, then c for DA1 or $ y for DECRQM
+        param[0] = param[1] = 0;
+        for (n = 0, j = k + 3; j < len; j++)
+            if (txt[j] >= '0' && txt[j] <= '9')
+            {
+                if (n < 2 && param[n] < 10000)
+                    param[n] = param[n] * 10 + txt[j] - '0';
+            } else if (txt[j] == ';')
+                n++;
+            else
+                break;
+
+        if (j < len && txt[j] == 'c')
+            attached = 1;
+        // ESC [ ? 69 ; mode $ y, modes 1 to 3 when it can be set
+        if (j + 1 < len && txt[j] == '$' && txt[j + 1] == 'y' && n == 1
+            && param[0] == 69)
+            *margins = param[1] >= 1 && param[1] <= 3;
+    }
+    return attached;
+}
+
+
+/***************************************************************
+ * Ask the terminal how it can scroll (DA1, and DECRQM for the *
+ * left/right margins), the answers come on fd "in"; returns   *
+ * r->scroll. Keys pressed while it waits are lost             *
+ ***************************************************************/
+int render_probe(struct renderer *r, int in)
+{
+    static const char ask[] = "\033[?69$p\033[c";
+    struct timespec t0, t1;
+    struct pollfd p;
+    char txt[256];
+    int len = 0, left = RENDER_PROBE, attached = 0, margins = 0, n;
+
+    r->scroll = RENDER_SCROLL_NONE;
+    if (r->fd < 0 || !isatty(r->fd) || !isatty(in)
+        || write(r->fd, ask, sizeof(ask) - 1) != sizeof(ask) - 1)
+        return r->scroll;
+
+    // Every terminal answers DA1, those knowing DECRQM answer it first
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    p.fd = in;
+    p.events = POLLIN;
+    while (!attached && left > 0 && len < (int)sizeof(txt))
+    {
+        if (poll(&p, 1, left) > 0)
+        {
+            n = read(in, txt + len, sizeof(txt) - len);
+            if (n > 0)
+                len += n;
+            else if (n == 0 || errno != EINTR)
+                break;
+        }
+        attached = RenderProbeAnswers(txt, len, &margins);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        left = RENDER_PROBE - ((t1.tv_sec - t0.tv_sec) * 1000
+                               + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    }
+
+    if (attached)
+        r->scroll = margins ? RENDER_SCROLL_MARGINS : RENDER_SCROLL_ROWS;
+    r->full = 1; // Whatever the terminal made of the questions goes
+    return r->scroll;
+}
+
+
+/***************************************************************
+ * Compose what shifts the board on the terminal by dy rows    *
+ * and dx columns (the view going down and right when they are *
+ * positive), returns the number of bytes                      *
+ ***************************************************************/
+int RenderShiftSequence(struct renderer *r, int dy, int dx, char *txt)
+{
+    int n = 0, y;
+
+    if (r->scroll == RENDER_SCROLL_MARGINS && dx)
+    {
+        // The board is the scroll region, on all four sides
+        n += RenderCsi(txt + n, -1, -1, "?69h");
+        n += RenderCsi(txt + n, 1, BOARD_WIDTH, "s");
+        n += RenderCsi(txt + n, 1, BOARD_HIGH, "r");
+        n += RenderCsi(txt + n, 1, 1, "H");
+        if (dy)
+            n += RenderCsi(txt + n, dy > 0 ? dy : -dy, -1, dy > 0 ? "M" : "L");
+        n += RenderCsi(txt + n, dx > 0 ? dx : -dx, -1, dx > 0 ? "'~" : "'}");
+        n += RenderCsi(txt + n, -1, -1, "?69l");
+        n += RenderCsi(txt + n, -1, -1, "r");
+        return n;
+    }
+
+    if (dy)
+    {
+        // Lines deleted at the top of the region come in blank at its
+        // bottom, the status line below it stays
+        n += RenderCsi(txt + n, 1, BOARD_HIGH, "r");
+        n += RenderCsi(txt + n, 1, 1, "H");
+        n += RenderCsi(txt + n, dy > 0 ? dy : -dy, -1, dy > 0 ? "M" : "L");
+        n += RenderCsi(txt + n, -1, -1, "r");
+    }
+    // Row by row, the cells right of the board are blank and stay so
+    for (y = 0; dx && y < BOARD_HIGH; y++)
+        if (dx > 0)
+        {
+            n += RenderCsi(txt + n, y + 1, 1, "H");
+            n += RenderCsi(txt + n, dx, -1, "P");
+        } else
+        {
+            n += RenderCsi(txt + n, y + 1, BOARD_WIDTH + dx + 1, "H");
+            n += RenderCsi(txt + n, -dx, -1, "P");
+            n += RenderCsi(txt + n, y + 1, 1, "H");
+            n += RenderCsi(txt + n, -dx, -1, "@");
+        }
+    return n;
+}
+
+
+/**************************************************************
+ * The cell of the board in prev at (y, x) once shifted by dy *
+ * rows and dx columns                                        *
+ **************************************************************/
+char RenderShifted(struct renderer *r, int dy, int dx, int y, int x)
+{
+    y += dy;
+    x += dx;
+    if (y < 0 || y >= BOARD_HIGH || x < 0 || x >= BOARD_WIDTH)
+        return ' ';
+    return r->prev[y][x];
+}
+
+
+/**********************************************************
+ * Cells of the board to send were prev shifted by dy, dx *
+ **********************************************************/
+int RenderMissing(struct renderer *r, int dy, int dx)
+{
+    int y, x, n = 0;
+
+    for (y = 0; y < BOARD_HIGH; y++)
+        for (x = 0; x < BOARD_WIDTH; x++)
+            n += !RenderSame(r, r->next[y][x], RenderShifted(r, dy, dx, y, x));
+    return n;
+}
+
+
+/****************************************************************
+ * When the view has scrolled, shift the board on the terminal, *
+ * and in prev as well, so the flush sends the cells coming in; *
+ * only when that takes fewer bytes than sending them again     *
+ ****************************************************************/
+void RenderShift(struct renderer *r)
+{
+    char txt[RENDER_SHIFT], board[BOARD_HIGH][BOARD_WIDTH];
+    int dy = r->view_y - r->shown_y, dx = r->view_x - r->shown_x, y, x, n, from;
+
+    if (r->scroll == RENDER_SCROLL_NONE || r->full || !r->view || !r->shown
+        || (!dy && !dx) || dy <= -BOARD_HIGH || dy >= BOARD_HIGH
+        || dx <= -BOARD_WIDTH || dx >= BOARD_WIDTH)
+        return;
+    n = RenderShiftSequence(r, dy, dx, txt);
+    if (RenderMissing(r, dy, dx) + n >= RenderMissing(r, 0, 0))
+        return;
+
+    if (!RenderNoBackground(r))
+    {
+        // Cells coming in blank take the background set
+        from = r->attr >= 0 ? r->attr : r->attrs;
+        render_put(r, r->sgr[from][0], r->sgr_len[from][0]);
+        r->attr = 0;
+    }
+    render_put(r, txt, n);
+    for (y = 0; y < BOARD_HIGH; y++)
+        for (x = 0; x < BOARD_WIDTH; x++)
+            board[y][x] = RenderShifted(r, dy, dx, y, x);
+    for (y = 0; y < BOARD_HIGH; y++)
+        memcpy(r->prev[y], board[y], BOARD_WIDTH);
+    r->stats.shifts++;
+}
+
+
+/***************************************************
+ * Compose the changed runs of cells and send them *
+ ***************************************************/
+void render_flush(struct renderer *r)
+{
+    struct timespec t0, t1;
+    unsigned long ns;
+    int y, x, end, last;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r->bytes = 0;
+    r->write_ns = 0;
+    RenderShift(r);
+
+    for (y = 0; y < FRAME_HIGH; y++)
+    {
+        if (!r->full && !memcmp(r->prev[y], r->next[y], FRAME_WIDTH))
+            continue;
+
+        for (x = 0; x < FRAME_WIDTH; x = end)
+        {
+            if (!r->full && RenderSame(r, r->prev[y][x], r->next[y][x]))
+            {
+                end = x + 1;
+                continue;
+            }
+
+            // Extend the run over short gaps of unchanged cells
+            last = x;
+            for (end = x + 1; end < FRAME_WIDTH && end - last <= RENDER_GAP; end++)
+                if (r->full || !RenderSame(r, r->prev[y][end], r->next[y][end]))
+                    last = end;
+            end = last + 1;
+
+            render_goto(r, y, x);
+            RenderCells(r, y, x, end);
+        }
+
+        memcpy(r->prev[y], r->next[y], FRAME_WIDTH);
+    }
+    r->full = 0;
+    r->shown = r->view;
+    r->shown_y = r->view_y;
+    r->shown_x = r->view_x;
+
+    if (r->bytes == 0)
+        return; // Nothing has changed
+    render_write(r);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+
+    r->stats.frames++;
+    r->stats.bytes += r->bytes;
+    if (r->bytes > r->stats.bytes_max)
+        r->stats.bytes_max = r->bytes;
+    r->stats.ns += ns;
+    if (ns > r->stats.ns_max)
+        r->stats.ns_max = ns;
+}
+
+
+/*****************************************************
+ * Compose the visable part of the board, around the *
+ * player (or where the player was last seen)        *
+ *****************************************************/
+void render_view(struct renderer *r, struct world *w)
+{
+    int starty, startx, posy, posx, y, x;
+
+    /* The player position, or the last known one */
+    startx = w->game.lastposx;
+    starty = w->game.lastposy;
+
+    // Scrolling the board, a level smaller than the view stays at 0
+    startx -= BOARD_WIDTH / 2;
+    if (startx > w->width - BOARD_WIDTH)
+        startx = w->width - BOARD_WIDTH;
+    if (startx < 0)
+        startx = 0;
+
+    starty -= BOARD_HIGH / 2;
+    if (starty > w->height - BOARD_HIGH)
+        starty = w->height - BOARD_HIGH;
+    if (starty < 0)
+        starty = 0;
+    r->view = 1;
+    r->view_y = starty;
+    r->view_x = startx;
+
+    // Draw the board, only the chunks under the view are read
+    posy = starty;
+    for (y = 0; y < BOARD_HIGH; y++)
+    {
+        posx = startx;
+        for (x = 0; x < BOARD_WIDTH; x++)
+        {
+            if (posy < w->height && posx < w->width)
+                r->next[y][x] = RENDER_TILE + GetBoard(w, posy, posx);
+            else
+                r->next[y][x] = ' ';
+            posx++;
+        }
+        posy++;
+    }
+}
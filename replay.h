@@ -0,0 +1,465 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Replay file: the keys of a game with the ticks they came at, enough to
+ * play the game again exactly. Numbers are varints (7 bits a byte, low
+ * first, the high bit set on all but the last byte).
+ *
+ *   "BRP2", seed, first level, number of levels, sizeof(struct snapshot)
+ *   records: (ticks since the last record << 2 | kind), then
+ *     REPLAY_KEY:      the key, given to world_key() before that tick
+ *     REPLAY_KEYFRAME: size and a snapshot of the world at that tick
+ *     REPLAY_END:      nothing, the game was left there
+ *     REPLAY_UNDO:     size and a snapshot, the world went back to it
+ *
+ * Keyframes are written every REPLAY_EVERY ticks, so playing up to
+ * a tick starts from the last keyframe (or undo) before it. They are snapshots as
+ * this build lays them out; a file from a build with another layout is
+ * played from the start.
+ *
+ * A "BRP1" file is the same but for the keys: the terminal's bytes, with
+ * 'A' to 'D' the arrows (the ends of their escape sequences).
+ */
+
+#include <time.h>
+
+#define REPLAY_MAGIC        "BRP2"
+#define REPLAY_MAGIC_BYTES  "BRP1" // Keys as the bytes of the terminal
+#define REPLAY_EVERY        3600 // Ticks between keyframes, a minute
+#define REPLAY_ALL          (~0UL)
+
+enum replay_record {REPLAY_KEY, REPLAY_KEYFRAME, REPLAY_END, REPLAY_UNDO};
+
+struct replay
+{
+    FILE *f;
+    unsigned long tick;   // Tick of the last record
+    struct snapshot *frame;
+    size_t frame_size;
+};
+
+/*
+ * The keys of a replay alone, to be pressed on a world of any seed.
+ * Keyframes are left out and so are undos, the keys after one were
+ * pressed on the world it went back to.
+ */
+struct replay_script
+{
+    int level;            // First level of the game
+    unsigned long *tick;  // The key is given before that tick
+    int *key;
+    int n;
+    unsigned long end;    // Tick the game was left at
+};
+
+
+void ReplayPut(FILE *f, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        fputc((v & 0x7F) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+
+/***************************************************
+ * Read a varint, 0 and p at the end when it's cut *
+ ***************************************************/
+unsigned long long ReplayGet(const unsigned char **p, const unsigned char *end)
+{
+    unsigned long long v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64)
+    {
+        v |= (unsigned long long)(**p & 0x7F) << shift;
+        shift += 7;
+        if (!(*(*p)++ & 0x80))
+            return v;
+    }
+    *p = end;
+    return 0;
+}
+
+
+void ReplayRecord(struct replay *r, unsigned long tick, int kind)
+{
+    ReplayPut(r->f, (unsigned long long)(tick - r->tick) << 2 | kind);
+    r->tick = tick;
+}
+
+
+/*****************************************
+ * Start recording the game, -1 on error *
+ *****************************************/
+int replay_create(struct replay *r, const char *path, uint64_t seed,
+                  int level, int levels_count)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "wb");
+    if (r->f == NULL)
+        return -1;
+
+    fwrite(REPLAY_MAGIC, 1, 4, r->f);
+    ReplayPut(r->f, seed);
+    ReplayPut(r->f, level);
+    ReplayPut(r->f, levels_count);
+    ReplayPut(r->f, sizeof(struct snapshot));
+    return 0;
+}
+
+
+void replay_key(struct replay *r, unsigned long tick, int key)
+{
+    if (r->f == NULL)
+        return;
+    ReplayRecord(r, tick, REPLAY_KEY);
+    ReplayPut(r->f, key);
+}
+
+
+void ReplayFrame(struct replay *r, unsigned long tick, int kind, struct world *w)
+{
+    size_t size = world_snapshot_size(w);
+    struct snapshot *s;
+
+    if (size > r->frame_size)
+    {
+        s = realloc(r->frame, size);
+        if (s == NULL)
+            return; // A keyframe only saves time (an undo is lost, though)
+        r->frame = s;
+        r->frame_size = size;
+    }
+    world_snapshot(w, r->frame);
+
+    ReplayRecord(r, tick, kind);
+    ReplayPut(r->f, size);
+    fwrite(r->frame, 1, size, r->f);
+    fflush(r->f); // A killed game still leaves most of its replay
+}
+
+
+/*******************************************
+ * Store the world, when a keyframe is due *
+ *******************************************/
+void replay_keyframe(struct replay *r, unsigned long tick, struct world *w)
+{
+    if (r->f != NULL && tick % REPLAY_EVERY == 0)
+        ReplayFrame(r, tick, REPLAY_KEYFRAME, w);
+}
+
+
+/*********************************************************
+ * The world was put back by undo, store where it is now *
+ *********************************************************/
+void replay_undo(struct replay *r, unsigned long tick, struct world *w)
+{
+    if (r->f != NULL)
+        ReplayFrame(r, tick, REPLAY_UNDO, w);
+}
+
+
+void replay_close(struct replay *r, unsigned long tick)
+{
+    if (r->f == NULL)
+        return;
+    ReplayRecord(r, tick, REPLAY_END);
+    fclose(r->f);
+    free(r->frame);
+    r->f = NULL;
+    r->frame = NULL;
+}
+
+
+/*******************************************************
+ * The whole file, NULL when it can't be read or isn't *
+ * a replay                                            *
+ *******************************************************/
+unsigned char *ReplayLoad(FILE *f, long *length)
+{
+    unsigned char *data = NULL;
+
+    *length = -1;
+    if (!fseek(f, 0, SEEK_END) && (*length = ftell(f)) >= 0 && !fseek(f, 0, SEEK_SET))
+        data = malloc(*length + 1);
+    if (data != NULL && (fread(data, 1, *length, f) != (size_t)*length
+        || *length < 4 || (memcmp(data, REPLAY_MAGIC, 4)
+        && memcmp(data, REPLAY_MAGIC_BYTES, 4))))
+    {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+
+/********************************************
+ * The key of a key record of the file data *
+ ********************************************/
+int ReplayKey(const unsigned char *data, unsigned long long key)
+{
+    if (!memcmp(data, REPLAY_MAGIC_BYTES, 4) && key >= 'A' && key <= 'D')
+        return KEY_UP + key - 'A';
+    return key;
+}
+
+
+void replay_script_free(struct replay_script *r)
+{
+    free(r->tick);
+    free(r->key);
+    memset(r, 0, sizeof(*r));
+}
+
+
+/********************************************
+ * Read the keys of the replay, -1 on error *
+ ********************************************/
+int replay_script(struct replay_script *r, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    const unsigned char *p, *end;
+    unsigned char *data;
+    unsigned long long v, size;
+    unsigned long tick = 0;
+    long length;
+    int room = 0, err = 0;
+    void *grown;
+
+    memset(r, 0, sizeof(*r));
+    if (f == NULL)
+        return -1;
+    data = ReplayLoad(f, &length);
+    fclose(f);
+    if (data == NULL)
+        return -1;
+    p = data + 4;
+    end = data + length;
+
+    ReplayGet(&p, end); // The seed, the script is for any
+    r->level = ReplayGet(&p, end);
+    ReplayGet(&p, end);
+    ReplayGet(&p, end);
+    while (p < end)
+    {
+        v = ReplayGet(&p, end);
+        tick += v >> 2;
+        if ((v & 3) == REPLAY_END)
+            break;
+        if ((v & 3) != REPLAY_KEY)
+        {
+            size = ReplayGet(&p, end);
+            p += size < (unsigned long long)(end - p) ? (long)size : end - p;
+            continue;
+        }
+        if (r->n == room)
+        {
+            room = room ? 2 * room : 256;
+            if ((grown = realloc(r->tick, room * sizeof(*r->tick))) != NULL)
+                r->tick = grown;
+            if (grown == NULL || (grown = realloc(r->key, room * sizeof(*r->key))) == NULL)
+            {
+                err = 1;
+                break;
+            }
+            r->key = grown;
+        }
+        r->tick[r->n] = tick;
+        r->key[r->n++] = ReplayKey(data, ReplayGet(&p, end));
+    }
+    r->end = tick;
+    free(data);
+    if (err)
+        replay_script_free(r); // Out of memory
+    return err ? -1 : 0;
+}
+
+
+/********************************************************
+ * Step the world; with a trace, print its digest after *
+ * the tick so two runs can be compared tick by tick    *
+ ********************************************************/
+void ReplayTick(struct world *w, unsigned long tick, FILE *trace)
+{
+    struct world_digest d;
+
+    world_step(w);
+    if (trace == NULL)
+        return;
+    d = world_digest(w);
+    fprintf(trace, "%lu %016llx %d %d\n", tick, (unsigned long long)d.hash,
+        d.diamonds, d.time);
+}
+
+
+/**************************************************************
+ * Play the replay with no terminal and no waiting, up to the *
+ * tick "to" (or REPLAY_ALL), and print where it ended up;    *
+ * the digest of every tick goes to trace, if not NULL        *
+ **************************************************************/
+int replay_play(const char *path, const struct level *levels, int count,
+                unsigned long to, FILE *trace)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data;
+    const unsigned char *p, *end, *first, *from = NULL, *next;
+    unsigned long long seed, v, size, from_size = 0;
+    unsigned long tick, at, from_tick = 0, mismatch = 0, checked = 0;
+    struct snapshot *s = NULL;
+    struct timespec t0, t1;
+    struct world *w = NULL;
+    long length;
+    int level, frames, err = 1;
+    double sec;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "%s: can't open\n", path);
+        return -1;
+    }
+    data = ReplayLoad(f, &length);
+    if (data == NULL)
+    {
+        fprintf(stderr, "%s: not a replay\n", path);
+        goto fail;
+    }
+    p = data + 4;
+    end = data + length;
+
+    seed = ReplayGet(&p, end);
+    level = ReplayGet(&p, end);
+    if ((int)ReplayGet(&p, end) != count)
+    {
+        fprintf(stderr, "%s: recorded with another set of levels\n", path);
+        goto fail;
+    }
+    frames = ReplayGet(&p, end) == sizeof(struct snapshot);
+    first = p;
+
+    // The last keyframe or undo not after the wanted tick
+    for (tick = 0; frames && to != REPLAY_ALL && p < end; )
+    {
+        v = ReplayGet(&p, end);
+        at = tick + (v >> 2);
+        if (at > to || (v & 3) == REPLAY_END)
+            break;
+        tick = at;
+        if ((v & 3) == REPLAY_KEY)
+        {
+            ReplayGet(&p, end);
+            continue;
+        }
+        size = ReplayGet(&p, end);
+        if (size > (unsigned long long)(end - p))
+            break;
+        from = p;
+        from_size = size;
+        from_tick = tick;
+        p += size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    w = world_create_levels(levels, count, level);
+    if (w == NULL)
+        goto fail;
+    world_seed(w, seed);
+    tick = 0;
+    p = first;
+    if (from != NULL)
+    {
+        if (from_size < sizeof(struct snapshot)
+            || world_restore(w, (const struct snapshot*)from) < 0
+            || world_snapshot_size(w) != from_size)
+        {
+            fprintf(stderr, "%s: broken snapshot at tick %lu\n", path, from_tick);
+            goto fail;
+        }
+        tick = from_tick;
+        p = from + from_size;
+    }
+
+    // Records come in tick order, the world is stepped up to each one
+    for (at = tick; p < end; tick = at)
+    {
+        next = p;
+        v = ReplayGet(&next, end);
+        at = tick + (v >> 2);
+        if (at >= to)
+            break; // The world at a tick is the one before its keys
+        for (; tick < at; tick++)
+            ReplayTick(w, tick, trace);
+        p = next;
+
+        if ((v & 3) == REPLAY_END)
+            break;
+        if ((v & 3) == REPLAY_KEY)
+        {
+            world_key(w, ReplayKey(data, ReplayGet(&p, end)));
+            continue;
+        }
+
+        size = ReplayGet(&p, end);
+        if (size > (unsigned long long)(end - p))
+            break;
+        if ((v & 3) == REPLAY_UNDO)
+        {
+            if (!frames || size < sizeof(struct snapshot)
+                || world_restore(w, (const struct snapshot*)p) < 0)
+            {
+                fprintf(stderr, "%s: can't undo at tick %lu\n", path, tick);
+                goto fail;
+            }
+            p += size;
+            continue;
+        }
+
+        // Played up to a keyframe: it must be the world we have
+        if (frames)
+        {
+            if (size == world_snapshot_size(w))
+            {
+                s = realloc(s, size);
+                if (s == NULL)
+                    goto fail;
+                world_snapshot(w, s);
+            }
+            checked++;
+            if ((size != world_snapshot_size(w) || memcmp(s, p, size))
+                && mismatch++ == 0)
+                fprintf(stderr, "%s: the game differs from the keyframe at "
+                    "tick %lu\n", path, tick);
+        }
+        p += size;
+    }
+    for (; to != REPLAY_ALL && tick < to; tick++)
+        ReplayTick(w, tick, trace); // Past the end of the game nobody
+                                    // touches the keys
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("tick %lu level %d diamonds %d time %d hero %s checksum %016llx\n",
+        tick, w->game.current_level + 1, w->game.diamonds, w->game.time,
+        w->game.hero_state == KILLED ? "dead" : "alive",
+        (unsigned long long)world_checksum(w));
+    printf("played %lu ticks from %lu in %.3f s", tick - from_tick, from_tick, sec);
+    if (sec > 0)
+        printf(", %.0f ticks/s", (tick - from_tick) / sec);
+    printf(", keyframes checked %lu, differing %lu\n", checked, mismatch);
+    err = mismatch ? 1 : 0;
+
+fail:
+    fclose(f);
+    if (w != NULL)
+        world_destroy(w);
+    free(s);
+    free(data);
+    return err ? -1 : 0;
+}
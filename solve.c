@@ -0,0 +1,954 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Level solver: looks for the keys which take the player through the door
+ * of a level before its time is out. It is a weighted A* over the worlds:
+ * a step is a key (or none) and the ticks up to the next one, SOLVE_MOVES
+ * of them between two moves of the objects. Besides the single keys, a
+ * state is left by walks to the nearest diamonds (or the door), a step at
+ * a time and around what would kill. Every thread keeps its own open list
+ * of snapshots; the table of the states seen, with the fewest steps each
+ * was reached in, is shared by the threads and taken without locks.
+ * The levels not solved are listed at the end, and make the exit status 1.
+ */
+
+#include "world.h"
+#include "pack.h"
+#include "replay.h"
+#include <getopt.h>
+#include <pthread.h>
+
+#define SOLVE_STEP          (INTER_TIME / 5 + 1) // Ticks between moves of objects
+#define SOLVE_MOVES         2   // Keys of the player in that time
+#define SOLVE_SECONDS       30  // Search time of a level
+#define SOLVE_WEIGHT        3   // Of the estimate against the steps made
+#define SOLVE_MEMORY        1024 // Megabytes of open states, all threads
+#define TABLE_BITS          22  // States in the table, 16 bytes each
+#define TABLE_PROBES        32  // Slots tried before a state is let through
+#define SOLVE_GOALS         6   // Nearest goals walked to from a state
+#define WALK_WAITS          8   // Steps a walk may wait for the way to clear
+#define SEED_STATES         16  // Open states a thread starts with
+#define BLOCK_NODES         4096
+
+enum action {ACT_WAIT, ACT_UP, ACT_DOWN, ACT_LEFT, ACT_RIGHT, ACT_DIG_UP,
+             ACT_DIG_DOWN, ACT_DIG_LEFT, ACT_DIG_RIGHT, ACTIONS};
+
+// Keys of the actions, a space first for the moves without moving
+const char *ActionKeys[ACTIONS] = {"", "w", "s", "a", "d", " w", " s", " a", " d"};
+const char ActionNames[ACTIONS + 1] = ".wsadWSAD";
+
+struct node
+{
+    struct node *parent;
+    struct snapshot *state; // Freed once the node is expanded
+    int steps;
+    int f;                  // Steps and the weighted estimate, the order
+    int h;
+    int action;             // Taken from the parent, when not walked
+    unsigned char *path;    // Actions of a walk to a goal, or NULL
+    int length;
+};
+
+struct block
+{
+    struct block *next;
+    int n;
+    struct node node[BLOCK_NODES];
+};
+
+/*
+ * States seen: a slot is taken by setting its key from 0 with a
+ * compare-and-swap, then its steps only ever go down.
+ */
+struct table
+{
+    uint64_t *key;
+    uint32_t *steps;
+};
+
+struct search
+{
+    const struct level *levels;
+    int count;
+    int level;
+    uint64_t seed;
+    int weight;
+    double deadline;        // CLOCK_MONOTONIC seconds
+    size_t budget;          // Bytes of open states of a thread
+    struct table table;
+    struct node *solution;  // Set once, by the thread which found it
+    int stop;
+};
+
+struct worker
+{
+    struct search *s;
+    pthread_t thread;
+    struct world *w;        // The world the actions are tried on
+    struct world *base;     // The state being expanded
+    struct world *trial;    // A step of a walk, before it's taken
+    struct node **open;     // Heap on f, then h
+    int n, size;
+    struct block *blocks;
+    size_t bytes;           // Of the open states
+    unsigned *seen;         // Spread() marks the cells with pass
+    int *dist;
+    unsigned char *back;
+    int *queue;
+    int *route;             // Of the walk being made, see Plan()
+    unsigned char *path;    // Of the walk being made
+    int goals[SOLVE_GOALS];
+    unsigned pass;
+    int cells;
+    unsigned long long expanded;
+    int full;               // Stopped at the memory budget
+};
+
+/********************
+ * Global variables *
+ ********************/
+struct level *Levels;
+int LevelsCount;
+int Threads;
+int Weight = SOLVE_WEIGHT;
+double Seconds = SOLVE_SECONDS;
+size_t Memory = (size_t)SOLVE_MEMORY << 20;
+unsigned long long Seed = WORLD_SEED;
+char *ReplayDir;            // Write the solutions there as replays
+int ShowKeys;               // The keys solving, the states of every thread
+
+
+double Now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/******************************************************************
+ * Press the keys of the action and step up to the next one, when *
+ * the clock of the objects is at a multiple of SOLVE_STEP /       *
+ * SOLVE_MOVES; returns the events of world_step(), the ticks are  *
+ * added to *ticks                                                 *
+ ******************************************************************/
+int Advance(struct world *w, int action, unsigned long *ticks)
+{
+    const char *key;
+    int events = 0;
+
+    for (key = ActionKeys[action]; *key; key++)
+        world_key(w, *key);
+    do
+    {
+        events |= world_step(w);
+        (*ticks)++;
+    }
+    while (!(events & (WORLD_LEVEL_DONE | WORLD_GAME_OVER))
+           && (w->refresh_timer % (INTER_TIME / 5 / SOLVE_MOVES)
+               || w->refresh_timer == INTER_TIME / 5));
+    return events;
+}
+
+
+/******************************************************************
+ * Key of the state: the hash of the cells kept by the world, the *
+ * random generator, the clock of the objects and the diamonds    *
+ * left. The time is not in it, fewer steps is just better        *
+ ******************************************************************/
+uint64_t StateKey(struct world *w)
+{
+    uint64_t h = world_digest(w).hash;
+
+    h = (h ^ w->random) * 1099511628211ULL;
+    h = (h ^ w->refresh_timer) * 1099511628211ULL;
+    h = (h ^ w->game.diamonds) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+
+/********************************************************************
+ * Note the state reached in the steps, 1 if it's new or reached in *
+ * fewer steps than before (worth a search)                         *
+ ********************************************************************/
+int TableVisit(struct table *t, uint64_t key, uint32_t steps)
+{
+    uint64_t seen;
+    uint32_t old;
+    unsigned k, probe;
+
+    k = (key * 0x9E3779B97F4A7C15ULL) >> (64 - TABLE_BITS);
+    for (probe = 0; probe < TABLE_PROBES; probe++, k = (k + 1) & ((1 << TABLE_BITS) - 1))
+    {
+        seen = __atomic_load_n(&t->key[k], __ATOMIC_ACQUIRE);
+        if (seen == 0)
+        {
+            __atomic_compare_exchange_n(&t->key[k], &seen, key, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            if (seen != 0 && seen != key)
+                continue; // Taken by another state meanwhile
+        } else if (seen != key)
+            continue;
+
+        old = __atomic_load_n(&t->steps[k], __ATOMIC_RELAXED);
+        do
+            if (old <= steps)
+                return 0;
+        while (!__atomic_compare_exchange_n(&t->steps[k], &old, steps, 1,
+                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return 1;
+    }
+    return 1; // No room around, it may be searched twice
+}
+
+
+const int StepY[4] = {-1, 1, 0, 0}, StepX[4] = {0, 0, -1, 1};
+const int StepAction[4] = {ACT_UP, ACT_DOWN, ACT_LEFT, ACT_RIGHT};
+
+
+/**************************************************************
+ * Can the player step from the cell in the direction; a rock *
+ * is pushed aside into a tunnel, and with "rocks" is let by  *
+ **************************************************************/
+int Passable(struct world *w, int j, int i, int d, int rocks)
+{
+    int t = GetBoard(w, j + StepY[d], i + StepX[d]);
+
+    if (t == ROCK)
+        return rocks || (StepY[d] == 0
+                         && GetBoard(w, j, i + 2 * StepX[d]) == TUNNEL);
+    return t == TUNNEL || t == GROUND || t == DIAMOND || t == CRASH
+           || t == HERO || (t == DOOR && !w->game.diamonds);
+}
+
+
+/********************************************************************
+ * Breadth first from the cell over where the player can go now, up *
+ * to the cell "to" or the first max cells of the tile next to the  *
+ * way, which go to found (if not NULL); returns how many. For the  *
+ * cells stamped with wk->pass, wk->dist has the steps and wk->back *
+ * the last one.                                                    *
+ ********************************************************************/
+int Spread(struct worker *wk, struct world *w, int from, int to, int tile,
+           int *found, int max, int rocks)
+{
+    int head = 0, tail = 0, n = 0, c, next, j, i, d, nj, ni;
+
+    if (++wk->pass == 0)
+    {
+        memset(wk->seen, 0, wk->cells * sizeof(unsigned));
+        wk->pass = 1;
+    }
+    wk->queue[tail++] = from;
+    wk->seen[from] = wk->pass;
+    wk->dist[from] = 0;
+
+    while (head < tail)
+    {
+        c = wk->queue[head++];
+        if (c == to)
+            break;
+        j = c / w->width;
+        i = c % w->width;
+        for (d = 0; d < 4 && (n < max || found == NULL); d++)
+        {
+            nj = j + StepY[d];
+            ni = i + StepX[d];
+            if ((unsigned)nj >= (unsigned)w->height || (unsigned)ni >= (unsigned)w->width)
+                continue; // Beyond the edges of a level without a border
+            next = nj * w->width + ni;
+            if (wk->seen[next] == wk->pass)
+                continue;
+            if (GetBoard(w, nj, ni) == tile)
+                found[n++] = next; // Even if it can't be stepped on
+            else if (!Passable(w, j, i, d, rocks))
+                continue;
+            wk->seen[next] = wk->pass;
+            wk->dist[next] = wk->dist[c] + 1;
+            wk->back[next] = d;
+            if (Passable(w, j, i, d, rocks))
+                wk->queue[tail++] = next;
+        }
+        if (n == max && found != NULL)
+            break;
+    }
+    return n;
+}
+
+
+/***********************************************************************
+ * Steps to the goal (the nearest diamond, the fly to make them of, or *
+ * the door once they're all taken) around the rocks; -1 when the      *
+ * level can't be finished from the state in the steps the time leaves *
+ ***********************************************************************/
+int Estimate(struct worker *wk, struct world *w)
+{
+    int goal = !w->game.diamonds ? DOOR : w->count[DIAMOND] ? DIAMOND : FLY;
+    int hy, hx, j, i, c, d, near, left;
+
+    if (FindObject(w, HERO, &hy, &hx) != HERO)
+        return -1;
+    if (w->count[DIAMOND] + 9 * w->count[FLY] < w->game.diamonds)
+        return -1; // A fly makes nine of them
+
+    // No faster than straight to the nearest goal
+    near = -1;
+    for (j = 1; j < w->height - 1; j++)
+        for (i = 1; i < w->width - 1; i++)
+            if (GetBoard(w, j, i) == goal)
+            {
+                d = abs(j - hy) + abs(i - hx);
+                if (near < 0 || d < near)
+                    near = d;
+            }
+    left = (w->game.time * (INTER_TIME + 1) + w->time_timer)
+           * SOLVE_MOVES / SOLVE_STEP;
+    if (w->game.diamonds)
+    {
+        if (near < 0)
+            near = 1; // The flies have them
+        near += w->game.diamonds; // And one more step a diamond
+    }
+    if (near < 0 || near > left)
+        return -1;
+
+    // A diamond left counts as the longest way there is, so that taking
+    // one is always better, however far the next one is
+    d = w->game.diamonds * wk->cells;
+    if (Spread(wk, w, hy * w->width + hx, -1, goal, &c, 1, 0))
+        return d + wk->dist[c];
+    // Walled in, as bad as one more diamond: the rocks may move but a
+    // state with the way open is better
+    if (Spread(wk, w, hy * w->width + hx, -1, goal, &c, 1, 1))
+        return d + wk->cells + wk->dist[c];
+    return d + wk->cells + near;
+}
+
+
+int StepTo(struct world *w, int from, int to)
+{
+    return to == from - w->width ? 0 : to == from + w->width ? 1
+           : to == from - 1 ? 2 : 3;
+}
+
+
+/****************************************************************
+ * Cells of the shortest way from the player to the target into *
+ * wk->route, the player first; returns how many, 0 if there's  *
+ * no way now                                                   *
+ ****************************************************************/
+int Plan(struct worker *wk, struct world *w, int hero, int target)
+{
+    int c, k;
+
+    Spread(wk, w, hero, target, -1, NULL, 0, 0);
+    if (wk->seen[target] != wk->pass)
+        return 0;
+    for (c = target, k = wk->dist[target]; k > 0; k--)
+    {
+        wk->route[k] = c;
+        c -= StepY[wk->back[c]] * w->width + StepX[wk->back[c]];
+    }
+    wk->route[0] = hero;
+    return wk->dist[target] + 1;
+}
+
+
+/********************************************************************
+ * Walk wk->w to the cell along the way planned (and planned again  *
+ * when the rocks block it), waiting when a step would kill; the    *
+ * actions go to wk->path. Returns the steps to the cell (or to the *
+ * level done), or -1                                               *
+ ********************************************************************/
+int Walk(struct worker *wk, int target, int max, int *events)
+{
+    struct world *w;
+    unsigned long ticks = 0;
+    int n, hy, hx, hero, a, e, at = 0, length = 0, waits = 0;
+
+    for (n = 0; n < max; n++)
+    {
+        w = wk->w;
+        if (FindObject(w, HERO, &hy, &hx) != HERO)
+            return -1;
+        hero = hy * w->width + hx;
+        if (hero == target)
+            return n;
+
+        if (at + 1 >= length || wk->route[at] != hero
+            || !Passable(w, hy, hx, StepTo(w, hero, wk->route[at + 1]), 0))
+        {
+            length = Plan(wk, w, hero, target);
+            at = 0;
+        }
+        a = at + 1 < length ? StepAction[StepTo(w, hero, wk->route[at + 1])]
+                            : ACT_WAIT;
+
+        if (world_copy(wk->trial, w) < 0)
+            return -1;
+        e = Advance(wk->trial, a, &ticks);
+        if (!(e & WORLD_LEVEL_DONE) && a != ACT_WAIT
+            && ((e & WORLD_GAME_OVER) || wk->trial->game.hero_state == KILLED))
+        {
+            a = ACT_WAIT;
+            world_copy(wk->trial, w);
+            e = Advance(wk->trial, a, &ticks);
+        }
+        if (!(e & WORLD_LEVEL_DONE)
+            && ((e & WORLD_GAME_OVER) || wk->trial->game.hero_state == KILLED))
+            return -1;
+        if (a == ACT_WAIT && ++waits > WALK_WAITS)
+            return -1;
+
+        wk->w = wk->trial;
+        wk->trial = w;
+        wk->path[n] = a;
+        if (a != ACT_WAIT)
+            at++;
+        *events |= e;
+        if (e & WORLD_LEVEL_DONE)
+            return n + 1;
+    }
+    return -1;
+}
+
+
+/*****************
+ * The open heap *
+ *****************/
+int Before(struct node *a, struct node *b)
+{
+    return a->f < b->f || (a->f == b->f && a->h < b->h);
+}
+
+
+int PushOpen(struct worker *wk, struct node *n)
+{
+    struct node **open;
+    int k;
+
+    if (wk->n == wk->size)
+    {
+        open = realloc(wk->open, (wk->size * 2 + 64) * sizeof(*open));
+        if (open == NULL)
+            return -1;
+        wk->open = open;
+        wk->size = wk->size * 2 + 64;
+    }
+    for (k = wk->n++; k > 0 && Before(n, wk->open[(k - 1) / 2]); k = (k - 1) / 2)
+        wk->open[k] = wk->open[(k - 1) / 2];
+    wk->open[k] = n;
+    return 0;
+}
+
+
+struct node *PopOpen(struct worker *wk)
+{
+    struct node *top, *last;
+    int k, c;
+
+    if (wk->n == 0)
+        return NULL;
+    top = wk->open[0];
+    last = wk->open[--wk->n];
+    for (k = 0; (c = 2 * k + 1) < wk->n; k = c)
+    {
+        if (c + 1 < wk->n && Before(wk->open[c + 1], wk->open[c]))
+            c++;
+        if (!Before(wk->open[c], last))
+            break;
+        wk->open[k] = wk->open[c];
+    }
+    wk->open[k] = last;
+    return top;
+}
+
+
+/******************************************************************
+ * New node with the snapshot of the world (and the walk to it    *
+ * in wk->path when length is not 0), NULL when there's no memory *
+ ******************************************************************/
+struct node *NewNode(struct worker *wk, struct node *parent, int action,
+                     int length, struct world *w)
+{
+    struct block *b = wk->blocks;
+    struct node *n;
+    size_t size = world_snapshot_size(w);
+
+    if (b == NULL || b->n == BLOCK_NODES)
+    {
+        b = malloc(sizeof(struct block));
+        if (b == NULL)
+            return NULL;
+        b->next = wk->blocks;
+        b->n = 0;
+        wk->blocks = b;
+    }
+    n = &b->node[b->n];
+    n->state = malloc(size);
+    n->path = NULL;
+    if (length > 0)
+        n->path = malloc(length);
+    if (n->state == NULL || (length > 0 && n->path == NULL))
+    {
+        free(n->state);
+        free(n->path);
+        return NULL;
+    }
+    b->n++;
+    world_snapshot(w, n->state);
+    wk->bytes += size;
+
+    n->parent = parent;
+    n->action = action;
+    n->length = length;
+    if (length > 0)
+        memcpy(n->path, wk->path, length);
+    n->steps = parent == NULL ? 0 : parent->steps + (length > 0 ? length : 1);
+    n->h = 0;
+    n->f = 0;
+    return n;
+}
+
+
+void FreeState(struct worker *wk, struct node *n)
+{
+    if (n->state == NULL)
+        return;
+    wk->bytes -= world_snapshot_size(wk->base);
+    free(n->state);
+    n->state = NULL;
+}
+
+
+/*********************************************************************
+ * The state wk->w reached from the node: into the open list, or the *
+ * solution. Returns -1 when the expansion is to stop there.         *
+ *********************************************************************/
+int Child(struct worker *wk, struct node *n, int action, int length, int events)
+{
+    struct search *s = wk->s;
+    struct world *w = wk->w;
+    struct node *child, *none = NULL;
+    int h;
+
+    if (events & WORLD_LEVEL_DONE)
+    {
+        child = NewNode(wk, n, action, length, w);
+        if (child != NULL
+            && __atomic_compare_exchange_n(&s->solution, &none, child, 0,
+                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+    if ((events & WORLD_GAME_OVER) || w->game.hero_state == KILLED)
+        return 0;
+    h = Estimate(wk, w);
+    if (h < 0 || !TableVisit(&s->table, StateKey(w),
+                             n->steps + (length > 0 ? length : 1)))
+        return 0;
+
+    child = NewNode(wk, n, action, length, w);
+    if (child == NULL)
+    {
+        wk->full = 1;
+        return -1;
+    }
+    child->h = h;
+    child->f = child->steps + s->weight * h;
+    if (PushOpen(wk, child) < 0)
+    {
+        wk->full = 1;
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************
+ * Try every action from the node, then walks to the  *
+ * nearest goals; the children get into the open list *
+ ******************************************************/
+void Expand(struct worker *wk, struct node *n)
+{
+    struct search *s = wk->s;
+    struct world *b = wk->base;
+    unsigned long ticks = 0;
+    int a, k, goals, hy, hx, events, length, dist[SOLVE_GOALS];
+
+    if (world_restore(b, n->state) < 0)
+        return;
+    FreeState(wk, n);
+    wk->expanded++;
+
+    for (a = 0; a < ACTIONS && !__atomic_load_n(&s->stop, __ATOMIC_RELAXED); a++)
+    {
+        if (world_copy(wk->w, b) < 0)
+            return;
+        if (Child(wk, n, a, 0, Advance(wk->w, a, &ticks)) < 0)
+            return;
+    }
+
+    if (FindObject(b, HERO, &hy, &hx) != HERO)
+        return;
+    goals = Spread(wk, b, hy * b->width + hx, -1, b->game.diamonds ? DIAMOND : DOOR,
+                   wk->goals, SOLVE_GOALS, 0);
+    for (k = 0; k < goals; k++)
+        dist[k] = wk->dist[wk->goals[k]];
+
+    for (k = 0; k < goals && !__atomic_load_n(&s->stop, __ATOMIC_RELAXED); k++)
+    {
+        if (dist[k] < 2)
+            continue; // A single action does it
+        if (world_copy(wk->w, b) < 0)
+            return;
+        events = 0;
+        length = Walk(wk, wk->goals[k], 2 * dist[k] + WALK_WAITS, &events);
+        if (length > 0 && Child(wk, n, ACT_WAIT, length, events) < 0)
+            return;
+    }
+}
+
+
+void *SearchThread(void *arg)
+{
+    struct worker *wk = arg;
+    struct search *s = wk->s;
+    struct node *n;
+
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE) && !wk->full
+           && (n = PopOpen(wk)) != NULL)
+    {
+        if (Now() > s->deadline) // Cheap next to an expansion
+            __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+        if (wk->bytes > s->budget)
+            wk->full = 1;
+        else
+            Expand(wk, n);
+    }
+    return NULL;
+}
+
+
+int InitWorker(struct worker *wk, struct search *s)
+{
+    const struct level *l = &s->levels[s->level];
+
+    memset(wk, 0, sizeof(*wk));
+    wk->s = s;
+    wk->cells = l->width * l->height;
+    wk->w = world_create_levels(s->levels, s->count, s->level);
+    wk->base = world_create_levels(s->levels, s->count, s->level);
+    wk->trial = world_create_levels(s->levels, s->count, s->level);
+    wk->seen = calloc(wk->cells, sizeof(unsigned));
+    wk->dist = malloc(wk->cells * sizeof(int));
+    wk->back = malloc(wk->cells);
+    wk->queue = malloc(wk->cells * sizeof(int));
+    wk->route = malloc(wk->cells * sizeof(int));
+    wk->path = malloc(2 * wk->cells + WALK_WAITS);
+    return wk->w != NULL && wk->base != NULL && wk->trial != NULL
+           && wk->seen != NULL && wk->dist != NULL && wk->back != NULL
+           && wk->queue != NULL && wk->route != NULL
+           && wk->path != NULL ? 0 : -1;
+}
+
+
+void FreeWorker(struct worker *wk)
+{
+    struct block *b;
+    int k;
+
+    while ((b = wk->blocks) != NULL)
+    {
+        for (k = 0; k < b->n; k++)
+        {
+            free(b->node[k].state);
+            free(b->node[k].path);
+        }
+        wk->blocks = b->next;
+        free(b);
+    }
+    if (wk->w != NULL)
+        world_destroy(wk->w);
+    if (wk->base != NULL)
+        world_destroy(wk->base);
+    if (wk->trial != NULL)
+        world_destroy(wk->trial);
+    free(wk->open);
+    free(wk->seen);
+    free(wk->dist);
+    free(wk->back);
+    free(wk->queue);
+    free(wk->route);
+    free(wk->path);
+}
+
+
+/******************************************************************
+ * Play the actions from the start of the level on a new world,   *
+ * returns the tick the level was done at or 0 if it wasn't; the  *
+ * seconds used go to "used". Writes the replay when there's dir. *
+ ******************************************************************/
+unsigned long Verify(struct search *s, const char *actions, int steps, int *used)
+{
+    struct world *w = world_create_levels(s->levels, s->count, s->level);
+    struct replay r;
+    char path[4096];
+    const char *key;
+    unsigned long tick = 0, done = 0;
+    int k, events, time;
+
+    if (w == NULL)
+        return 0;
+    world_seed(w, s->seed);
+    r.f = NULL;
+    if (ReplayDir != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/level-%02d.brp", ReplayDir, s->level + 1);
+        if (replay_create(&r, path, s->seed, s->level, s->count) < 0)
+            fprintf(stderr, "can't write %s\n", path);
+    }
+
+    for (k = 0; k < steps && !done; k++)
+    {
+        for (key = ActionKeys[(int)actions[k]]; *key; key++)
+            replay_key(&r, tick, *key); // Pressed by Advance()
+        time = w->game.time;
+        events = Advance(w, actions[k], &tick);
+        if (events & WORLD_GAME_OVER)
+            break;
+        if (events & WORLD_LEVEL_DONE)
+        {
+            done = tick;
+            *used = s->levels[s->level].time - time;
+        }
+    }
+
+    replay_close(&r, tick);
+    world_destroy(w);
+    return done;
+}
+
+
+/****************************************************
+ * Search the level, print what came of it; returns *
+ * 1 when it's solved                               *
+ ****************************************************/
+int SolveLevel(struct search *s, struct worker *wk)
+{
+    const struct level *l = &s->levels[s->level];
+    struct world *w;
+    struct node *n, *root;
+    unsigned long long expanded = 0;
+    unsigned long done = 0;
+    char *actions = NULL;
+    double t0 = Now();
+    int k, steps = 0, used = 0, full = 0, threads = Threads, open = 0;
+
+    memset(s->table.key, 0, sizeof(uint64_t) << TABLE_BITS);
+    memset(s->table.steps, 0xFF, sizeof(uint32_t) << TABLE_BITS);
+    s->solution = NULL;
+    s->stop = 0;
+    s->deadline = t0 + Seconds;
+    s->budget = Memory / threads;
+
+    for (k = 0; k < threads; k++)
+        if (InitWorker(&wk[k], s) < 0)
+        {
+            fprintf(stderr, "level %d: no memory for the search\n", s->level + 1);
+            threads = k + 1;
+            goto end;
+        }
+
+    // The start, then a few states for every thread
+    w = world_create_levels(s->levels, s->count, s->level);
+    if (w == NULL)
+        goto end;
+    world_seed(w, s->seed);
+    root = NewNode(&wk[0], NULL, ACT_WAIT, 0, w);
+    world_destroy(w);
+    if (root == NULL || PushOpen(&wk[0], root) < 0)
+        goto end;
+    while (wk[0].n > 0 && wk[0].n < threads * SEED_STATES && !s->stop
+           && Now() < s->deadline)
+        Expand(&wk[0], PopOpen(&wk[0]));
+    for (k = 1; threads > 1 && wk[0].n > threads - k; k = k % (threads - 1) + 1)
+    {
+        // Dealt in turn, the best first, some kept; the snapshot is
+        // charged to the thread which will free it
+        n = PopOpen(&wk[0]);
+        wk[0].bytes -= world_snapshot_size(wk[0].base);
+        wk[k].bytes += world_snapshot_size(wk[0].base);
+        if (PushOpen(&wk[k], n) < 0)
+            break;
+    }
+
+    for (k = 0; k < threads; k++)
+        if (pthread_create(&wk[k].thread, NULL, SearchThread, &wk[k]))
+            threads = k; // Those left are still searched by nobody
+    for (k = 0; k < threads; k++)
+        pthread_join(wk[k].thread, NULL);
+    threads = Threads;
+
+    if ((n = s->solution) != NULL)
+    {
+        steps = n->steps;
+        actions = malloc(steps + 1);
+        for (k = steps; n != NULL && n->parent != NULL; n = n->parent)
+            if (n->length > 0)
+                memcpy(actions + (k -= n->length), n->path, n->length);
+            else
+                actions[--k] = n->action;
+        done = Verify(s, actions, steps, &used);
+    }
+
+end:
+    for (k = 0; k < threads; k++)
+    {
+        expanded += wk[k].expanded;
+        full |= wk[k].full;
+        open += wk[k].n;
+        FreeWorker(&wk[k]);
+    }
+
+    printf("level %2d: ", s->level + 1);
+    if (actions != NULL && done)
+        printf("solved in %d steps, %lu ticks, %d of %d s", steps, done,
+            used, l->time);
+    else if (actions != NULL)
+        printf("found %d steps but they don't play back", steps);
+    else if (s->stop)
+        printf("not solved in %.0f s", Seconds);
+    else if (full)
+        printf("not solved, out of memory");
+    else
+        printf("not solved, no way found");
+    printf(", %llu states, %.2f s\n", expanded, Now() - t0);
+    if (actions != NULL && ShowKeys)
+    {
+        for (k = 0; k < steps; k++)
+            putchar(ActionNames[(int)actions[k]]);
+        putchar('\n');
+    }
+    if (ShowKeys && threads > 1)
+    {
+        printf("states by thread:");
+        for (k = 0; k < threads; k++)
+            printf(" %llu", wk[k].expanded);
+        putchar('\n');
+    }
+    fflush(stdout);
+    free(actions);
+    return done != 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct search s;
+    struct worker *wk;
+    int opt, k, first = 0, last = -1, solved = 0;
+    char *unsolved;
+    double t0 = Now();
+
+    Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "L:l:j:t:w:m:s:o:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'L':
+                Levels = world_open_pack(optarg, &LevelsCount);
+                if (Levels == NULL)
+                    Levels = world_read_levels(optarg, &LevelsCount);
+                if (Levels == NULL)
+                {
+                    fprintf(stderr, "%s: can't read levels from %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                first = last = atoi(optarg) - 1;
+                break;
+            case 'j':
+                Threads = atoi(optarg);
+                break;
+            case 't':
+                Seconds = atof(optarg);
+                break;
+            case 'w':
+                Weight = atoi(optarg);
+                break;
+            case 'm':
+                Memory = (size_t)atoi(optarg) << 20;
+                break;
+            case 's':
+                Seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'o':
+                ReplayDir = optarg;
+                break;
+            case 'v':
+                ShowKeys = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-L levels] [-l level] [-j threads] "
+                    "[-t seconds] [-w weight] [-m megabytes] [-s seed] "
+                    "[-o replay dir] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (Levels == NULL)
+    {
+        Levels = (struct level*)BuiltinLevels();
+        LevelsCount = LEVELS_NUMBERS;
+    }
+    if (last < 0)
+        last = LevelsCount - 1;
+    if (first < 0 || last >= LevelsCount)
+    {
+        fprintf(stderr, "%s: there are %d levels\n", argv[0], LevelsCount);
+        return 1;
+    }
+    if (Threads < 1)
+        Threads = 1;
+
+    memset(&s, 0, sizeof(s));
+    s.levels = Levels;
+    s.count = LevelsCount;
+    s.seed = Seed;
+    s.weight = Weight;
+    s.table.key = malloc(sizeof(uint64_t) << TABLE_BITS);
+    s.table.steps = malloc(sizeof(uint32_t) << TABLE_BITS);
+    wk = calloc(Threads, sizeof(struct worker));
+    unsolved = calloc(LevelsCount, 1);
+    if (s.table.key == NULL || s.table.steps == NULL || wk == NULL
+        || unsolved == NULL)
+    {
+        fprintf(stderr, "%s: no memory\n", argv[0]);
+        return 1;
+    }
+
+    for (k = first; k <= last; k++)
+    {
+        s.level = k;
+        unsolved[k] = !SolveLevel(&s, wk);
+        solved += !unsolved[k];
+    }
+    printf("solved %d of %d levels with %d threads in %.1f s\n",
+        solved, last - first + 1, Threads, Now() - t0);
+    if (solved < last - first + 1)
+    {
+        printf("not solved:");
+        for (k = first; k <= last; k++)
+            if (unsolved[k])
+                printf(" %d", k + 1);
+        putchar('\n');
+    }
+    return solved == last - first + 1 ? 0 : 1;
+}
@@ -0,0 +1,411 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Tests of the parts a game on a terminal can't show wrong on its own:
+ * the terminal probe of the renderer is fed canned answers, parsed
+ * alone and through a pty as a terminal would send them; a pack isn't
+ * written with numbers cut short; a recorded game plays back to the
+ * same world; the ticker without a timerfd must still wake for a key;
+ * the keys are parsed out of reads cut anywhere. Prints every check
+ * failed, exits 1 when any did.
+ */
+
+#define _GNU_SOURCE
+#include "world.h"
+#include "render.h"
+#include "pack.h"
+#include "replay.h"
+#include "ticker.h"
+#include "input.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <termios.h>
+
+struct renderer Screen;
+int Checks, Failed;
+
+
+void Check(int ok, const char *what)
+{
+    Checks++;
+    if (ok)
+        return;
+    Failed++;
+    printf("failed: %s\n", what);
+}
+
+
+/*****************************************************
+ * Levels too big for the numbers of a pack are left *
+ * unwritten, the built-in ones go there and back    *
+ *****************************************************/
+void CheckPack(void)
+{
+    struct level big, *back;
+    char path[] = "/tmp/boulder-test-XXXXXX";
+    int fd, count;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("skipped: packs, no temporary file\n");
+        return;
+    }
+    close(fd);
+
+    big = BuiltinLevels()[0];
+    big.time = 70000;
+    Check(world_write_pack(path, &big, 1) < 0, "pack of a level with a long time");
+
+    back = NULL;
+    if (world_write_pack(path, BuiltinLevels(), LEVELS_NUMBERS) == 0)
+        back = world_open_pack(path, &count);
+    Check(back != NULL && count == LEVELS_NUMBERS
+          && back[LEVELS_NUMBERS - 1].time == BuiltinLevels()[LEVELS_NUMBERS - 1].time,
+          "pack of the built-in levels");
+    unlink(path);
+}
+
+
+/*************************************************************
+ * Play the replay with its report taken off the output: the *
+ * tick it ended at and the checksum of the world then go to *
+ * tick and sum, the digest after the last tick played to d  *
+ *************************************************************/
+int PlayReplay(const char *path, unsigned long *tick, uint64_t *sum,
+               struct world_digest *d)
+{
+    FILE *report = tmpfile(), *trace = tmpfile();
+    char line[256], *at;
+    unsigned long long v;
+    int out, err, null, ret = -1;
+
+    *tick = REPLAY_ALL;
+    *sum = 0;
+    if (report == NULL || trace == NULL)
+        goto end;
+    fflush(stdout);
+    fflush(stderr);
+    out = dup(1);
+    err = dup(2);
+    null = open("/dev/null", O_WRONLY);
+    dup2(fileno(report), 1);
+    dup2(null, 2);
+    ret = replay_play(path, BuiltinLevels(), LEVELS_NUMBERS, REPLAY_ALL, trace);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, 1);
+    dup2(err, 2);
+    close(out);
+    close(err);
+    close(null);
+
+    rewind(report);
+    while (fgets(line, sizeof(line), report) != NULL)
+        if (sscanf(line, "tick %lu", tick) == 1
+            && (at = strstr(line, "checksum ")) != NULL
+            && sscanf(at, "checksum %llx", &v) == 1)
+            *sum = v;
+    rewind(trace);
+    while (fgets(line, sizeof(line), trace) != NULL)
+        if (sscanf(line, "%*s %llx %d %d", &v, &d->diamonds, &d->time) == 3)
+            d->hash = v;
+
+end:
+    if (report != NULL)
+        fclose(report);
+    if (trace != NULL)
+        fclose(trace);
+    return ret;
+}
+
+
+/**************************************************************
+ * A game recorded with keys and an undo plays back to the    *
+ * same world, so does a BRP1 file; a cut one plays up to the *
+ * cut, one cut in its magic doesn't                          *
+ **************************************************************/
+void CheckReplay(void)
+{
+    static const int keys[] = {KEY_RIGHT, KEY_DOWN, KEY_LEFT, KEY_UP};
+    char path[] = "/tmp/boulder-test-XXXXXX";
+    struct world_digest want, got;
+    struct snapshot *mark;
+    struct replay r;
+    struct world *w;
+    struct stat st;
+    unsigned long tick, played;
+    uint64_t sum;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(path);
+    w = world_create_levels(BuiltinLevels(), LEVELS_NUMBERS, 0);
+    if (fd < 0 || w == NULL)
+    {
+        printf("skipped: replays, no temporary file\n");
+        return;
+    }
+    close(fd);
+    mark = malloc(world_snapshot_size(w));
+
+    // Played as the game does it: keys and undos after the tick
+    world_seed(w, 1234);
+    replay_create(&r, path, 1234, 0, LEVELS_NUMBERS);
+    replay_keyframe(&r, 0, w);
+    for (tick = 0; tick < 200; )
+    {
+        world_step(w);
+        tick++;
+        replay_keyframe(&r, tick, w);
+        if (tick == 40)
+            world_snapshot(w, mark);
+        else if (tick == 120)
+        {
+            world_restore(w, mark);
+            replay_undo(&r, tick, w);
+        } else if (tick % 16 == 0)
+        {
+            replay_key(&r, tick, keys[tick / 16 % 4]);
+            world_key(w, keys[tick / 16 % 4]);
+        }
+    }
+    replay_close(&r, tick);
+    want = world_digest(w);
+    Check(PlayReplay(path, &played, &sum, &got) == 0 && played == tick
+          && sum == world_checksum(w) && got.hash == want.hash
+          && got.diamonds == want.diamonds && got.time == want.time,
+          "replay of keys and an undo");
+
+    stat(path, &st);
+    truncate(path, st.st_size / 2);
+    Check(PlayReplay(path, &played, &sum, &got) == 0 && played < tick,
+          "replay cut short");
+    truncate(path, 3);
+    Check(PlayReplay(path, &played, &sum, &got) < 0, "replay cut in its magic");
+
+    // The keys as the terminal's bytes, no keyframes
+    f = fopen(path, "wb");
+    fwrite(REPLAY_MAGIC_BYTES, 1, 4, f);
+    ReplayPut(f, 99);
+    ReplayPut(f, 0);
+    ReplayPut(f, LEVELS_NUMBERS);
+    ReplayPut(f, 0);
+    ReplayPut(f, 10 << 2 | REPLAY_KEY);
+    ReplayPut(f, 'C');
+    ReplayPut(f, 40 << 2 | REPLAY_END);
+    fclose(f);
+    world_destroy(w);
+    w = world_create_levels(BuiltinLevels(), LEVELS_NUMBERS, 0);
+    world_seed(w, 99);
+    for (tick = 0; tick < 50; tick++)
+    {
+        if (tick == 10)
+            world_key(w, KEY_RIGHT);
+        world_step(w);
+    }
+    want = world_digest(w);
+    Check(PlayReplay(path, &played, &sum, &got) == 0 && played == tick
+          && sum == world_checksum(w) && got.hash == want.hash,
+          "replay of a BRP1 file");
+
+    world_destroy(w);
+    free(mark);
+    unlink(path);
+}
+
+
+/**************************************************************
+ * The ticker without its timerfd: a key waiting on a pipe    *
+ * wakes it before the tick, an empty pipe waits for the tick *
+ **************************************************************/
+void CheckTickerFallback(void)
+{
+    struct ticker t;
+    struct pollfd fd;
+    char key;
+    int p[2];
+
+    if (pipe(p) < 0)
+    {
+        printf("skipped: ticker without a timerfd, no pipe\n");
+        return;
+    }
+    ticker_start(&t, 10, 0);
+    if (t.timer >= 0)
+        close(t.timer);
+    t.timer = -1;
+    fd.fd = p[0];
+    fd.events = POLLIN;
+
+    write(p[1], "x", 1);
+    Check(ticker_wait(&t, &fd, 1, 1) == 0 && t.ready && (fd.revents & POLLIN)
+          && t.stats.wakes == 1, "ticker without a timerfd woken by a key");
+    read(p[0], &key, 1);
+    Check(ticker_wait(&t, &fd, 1, 1) == 1 && !t.ready && fd.revents == 0
+          && t.stats.wakes == 2, "ticker without a timerfd waiting a tick");
+
+    close(p[0]);
+    close(p[1]);
+}
+
+
+/****************************************************************
+ * The reads (cut where "|" is) given to the parser must queue  *
+ * the keys, ended by 0                                         *
+ ****************************************************************/
+void CheckKeys(const char *reads, const int *keys, const char *what)
+{
+    struct input in;
+    const char *cut;
+    int p[2], k, ok = 1;
+
+    if (pipe(p) < 0)
+    {
+        printf("skipped: %s, no pipe\n", what);
+        return;
+    }
+    input_init(&in, p[0]);
+    while (*reads)
+    {
+        cut = strchr(reads, '|');
+        if (cut == NULL)
+            cut = reads + strlen(reads);
+        write(p[1], reads, cut - reads);
+        input_read(&in);
+        reads = *cut ? cut + 1 : cut;
+    }
+    for (k = 0; keys[k]; k++)
+        ok &= input_key(&in) == keys[k];
+    Check(ok && input_key(&in) < 0, what);
+
+    close(p[0]);
+    close(p[1]);
+}
+
+
+/***************************************************************
+ * Escape sequences parsed whole, however they are cut; a full *
+ * queue counts what it drops                                  *
+ ***************************************************************/
+void CheckInput(void)
+{
+    static const int up[] = {KEY_UP, 0}, down[] = {KEY_DOWN, 0};
+    static const int x[] = {'x', 0}, q[] = {'q', 0};
+    static const int arrows[] = {'a', KEY_LEFT, KEY_RIGHT, 'b', 0};
+    char many[300], longer[64];
+    struct input in;
+    int p[2];
+
+    CheckKeys("\033|[A", up, "arrow cut after the ESC");
+    CheckKeys("\033[|A", up, "arrow cut after the [");
+    CheckKeys("\033[1;5A", up, "arrow with modifiers");
+    CheckKeys("\033OB", down, "SS3 arrow");
+    CheckKeys("a\033[D\033OCb", arrows, "arrows between keys");
+    CheckKeys("\033x", x, "lone ESC before a letter");
+
+    memset(longer, '1', sizeof(longer));
+    memcpy(longer, "\033[", 2);
+    strcpy(longer + 40, "Cq");
+    CheckKeys(longer, q, "CSI too long");
+    longer[36] = '|';
+    CheckKeys(longer, q, "CSI too long, cut");
+
+    if (pipe(p) < 0)
+    {
+        printf("skipped: full key queue, no pipe\n");
+        return;
+    }
+    input_init(&in, p[0]);
+    memset(many, 'a', sizeof(many));
+    write(p[1], many, sizeof(many));
+    input_read(&in);
+    Check(in.last - in.first == INPUT_KEYS
+          && in.stats.dropped == sizeof(many) - INPUT_KEYS, "full key queue");
+    close(p[0]);
+    close(p[1]);
+}
+
+
+/**************************************************************
+ * The answers parsed alone: attached and margins as expected *
+ **************************************************************/
+void CheckAnswers(const char *txt, int attached, int margins, const char *what)
+{
+    int m = 0;
+
+    Check(RenderProbeAnswers(txt, strlen(txt), &m) == attached && m == margins,
+          what);
+}
+
+
+/************************************************************
+ * The probe on a pty answering "reply" at once (NULL for a *
+ * terminal which never answers) must find "scroll"         *
+ ************************************************************/
+void CheckProbe(const char *reply, int scroll, const char *what)
+{
+    struct termios raw;
+    char *name;
+    int master, slave;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0
+        || (name = ptsname(master)) == NULL
+        || (slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+    {
+        printf("skipped: %s, no pty\n", what);
+        if (master >= 0)
+            close(master);
+        return;
+    }
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+
+    // What the terminal sends comes in on the slave, the questions
+    // written there are left unread on the master
+    if (reply != NULL)
+        write(master, reply, strlen(reply));
+    render_init(&Screen, RenderThemes);
+    Screen.fd = slave;
+    Check(render_probe(&Screen, slave) == scroll, what);
+
+    close(slave);
+    close(master);
+}
+
+
+int main(void)
+{
+    CheckAnswers("\033[?69;2$y\033[?62;22c", 1, 1, "DECRQM reset and DA1");
+    CheckAnswers("\033[?69;1$y\033[?64;1;2;6;9;15;18;21;22c", 1, 1,
+                 "DECRQM set and a long DA1");
+    CheckAnswers("\033[?69;3$y\033[?1;2c", 1, 1, "DECRQM permanently set");
+    CheckAnswers("\033[?69;4$y\033[?1;2c", 1, 0, "DECRQM permanently reset");
+    CheckAnswers("\033[?69;0$y\033[?1;2c", 1, 0, "DECRQM not recognized");
+    CheckAnswers("\033[?6c", 1, 0, "DA1 alone");
+    CheckAnswers("\033[?69;2$y", 0, 1, "DECRQM without DA1 yet");
+    CheckAnswers("\033[?69;2$", 0, 0, "DECRQM cut short");
+    CheckAnswers("\033[?6", 0, 0, "DA1 cut short");
+    CheckAnswers("\033[?25;2$y\033[?1;2c", 1, 0, "DECRQM of another mode");
+    CheckAnswers("x\033[A\033[?69;2$y\033[?62c", 1, 1, "keys before the answers");
+
+    CheckProbe("\033[?69;2$y\033[?62;22c", RENDER_SCROLL_MARGINS,
+               "probe of a terminal with margins");
+    CheckProbe("\033[?1;2c", RENDER_SCROLL_ROWS,
+               "probe of a terminal without DECRQM");
+    CheckProbe("\033[?69;0$y\033[?1;2c", RENDER_SCROLL_ROWS,
+               "probe of a terminal without margins");
+    CheckProbe(NULL, RENDER_SCROLL_NONE, "probe of a terminal not answering");
+    CheckPack();
+    CheckReplay();
+    CheckTickerFallback();
+    CheckInput();
+
+    printf("%d of %d checks passed\n", Checks - Failed, Checks);
+    return Failed != 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Ticker: the game clock held to the monotonic clock. Tick n is due at
+ * base + n / hz seconds and the game sleeps until then with an absolute
+ * clock_nanosleep(), so the time a frame takes doesn't add up to drift.
+ * When woken late, the ticks already due are played back to back, up to
+ * catch_up of them besides the one waited for; beyond that the game is
+ * too far behind, the rest are dropped and the deadlines start again
+ * from now (catch_up 0 drops every late tick).
+ *
+ * The deadline is set on a timerfd and waited for in poll() together
+ * with the fds the game reads (the input), so a key wakes the game at
+ * once and nothing else does. Without a timerfd the fds are polled with
+ * the time left to the deadline, in milliseconds, and the last part of
+ * a millisecond is slept.
+ *
+ * When the game knows nothing will happen for a while, it waits for a
+ * tick further ahead and sleeps through the ones before it; they are
+ * played on waking, on time or not, as nothing could be seen of them.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#define TICKER_CATCH_UP     5   // Late ticks played back to back at most
+#define TICKER_FDS          4   // Polled besides the timer at most
+
+struct ticker_stats
+{
+    unsigned long wakes;
+    unsigned long ticks;      // Played
+    unsigned long caught_up;  // Played late, right after another one
+    unsigned long skipped;    // Dropped to get back on time
+    unsigned long slept;      // Played after sleeping through them
+    double jitter;            // Nanoseconds woken after the deadline,
+    double jitter_sq;         // sums of them and of their squares
+    uint64_t jitter_max;
+    uint64_t start;           // When the ticker was started
+};
+
+struct ticker
+{
+    int hz;
+    int catch_up;
+    uint64_t base;            // Monotonic nanoseconds of tick 0
+    unsigned long long n;     // The next tick to wait for
+    int timer;                // timerfd set to the deadline, or -1
+    uint64_t armed;           // Deadline it's set to
+    int ready;                // An fd woke the last wait
+    struct ticker_stats stats;
+};
+
+
+uint64_t TickerNow(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/*******************************************************
+ * When tick n is due, exact for any n (no rounding of *
+ * the period is added up)                             *
+ *******************************************************/
+uint64_t TickerDeadline(struct ticker *t, unsigned long long n)
+{
+    return t->base + n / t->hz * 1000000000ULL
+           + n % t->hz * 1000000000ULL / t->hz;
+}
+
+
+/**************************************************
+ * Count the ticks from now again, the stats stay *
+ * (after a pause the game made on purpose)       *
+ **************************************************/
+void ticker_resume(struct ticker *t)
+{
+    t->base = TickerNow();
+    t->n = 1;
+}
+
+
+void ticker_start(struct ticker *t, int hz, int catch_up)
+{
+    memset(t, 0, sizeof(*t));
+    t->hz = hz;
+    t->catch_up = catch_up > 0 ? catch_up : 0;
+    t->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ticker_resume(t);
+    t->stats.start = t->base;
+}
+
+
+/****************************************************************
+ * Wait on the timer and the fds until one is ready, 1 when any *
+ * of the fds (their revents say which)                         *
+ ****************************************************************/
+int TickerPoll(struct ticker *t, uint64_t deadline, struct pollfd *fd, int n)
+{
+    struct itimerspec it;
+    struct pollfd p[TICKER_FDS + 1];
+    uint64_t expired;
+    int k, ready = 0;
+
+    if (t->armed != deadline)
+    {
+        memset(&it, 0, sizeof(it));
+        it.it_value.tv_sec = deadline / 1000000000;
+        it.it_value.tv_nsec = deadline % 1000000000;
+        timerfd_settime(t->timer, TFD_TIMER_ABSTIME, &it, NULL);
+        t->armed = deadline;
+    }
+
+    // An fd of -1 is left out by poll()
+    p[0].fd = t->timer;
+    p[0].events = POLLIN;
+    memcpy(p + 1, fd, n * sizeof(*fd));
+    while (poll(p, n + 1, -1) < 0)
+        ; // A signal, wait on
+    for (k = 0; k < n; k++)
+        ready |= (fd[k].revents = p[k + 1].revents) != 0;
+    if (ready)
+        return 1;
+    read(t->timer, &expired, sizeof(expired));
+    return 0;
+}
+
+
+/****************************************************************
+ * Without the timer: poll() the fds until the deadline, 1 when *
+ * any of them got ready first (their revents say which)        *
+ ****************************************************************/
+int TickerPollUntil(uint64_t deadline, struct pollfd *fd, int n)
+{
+    struct timespec ts;
+    uint64_t now;
+    int ready;
+
+    while ((now = TickerNow()) < deadline)
+    {
+        if (deadline - now >= 1000000)
+        {
+            ready = poll(fd, n, (deadline - now) / 1000000);
+            if (ready > 0)
+                return 1;
+            if (ready == 0 || errno == EINTR)
+                continue;
+        }
+
+        // Less than a millisecond left, or poll() can't be had
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ; // A signal, the deadline is still the same
+        break;
+    }
+    return 0;
+}
+
+
+/************************************************
+ * Ticks from t->n on that are due by now, when *
+ * fewer than "ahead"                           *
+ ************************************************/
+int TickerPassed(struct ticker *t, uint64_t now, int ahead)
+{
+    int due;
+
+    for (due = 0; due < ahead && TickerDeadline(t, t->n + due) <= now; due++)
+        ;
+    return due;
+}
+
+
+/*****************************************************************
+ * Sleep until the tick "ahead" ticks on (1 for the next one) is *
+ * due, returns the number of ticks to play now: "ahead" or more *
+ * when late. When any of the n fds (up to TICKER_FDS) gets      *
+ * ready first, t->ready is set, their revents say which, and    *
+ * only the ticks due by then are returned                       *
+ *****************************************************************/
+int ticker_wait(struct ticker *t, struct pollfd *fd, int n, int ahead)
+{
+    struct ticker_stats *s = &t->stats;
+    uint64_t deadline = TickerDeadline(t, t->n + ahead - 1), now, late;
+    int due, k, ready;
+
+    t->ready = 0;
+    for (k = 0; k < n; k++)
+        fd[k].revents = 0;
+    if (TickerNow() < deadline)
+    {
+        if (t->timer >= 0)
+            ready = TickerPoll(t, deadline, fd, n);
+        else
+            ready = TickerPollUntil(deadline, fd, n);
+        if (ready)
+        {
+            t->ready = 1;
+            s->wakes++;
+            due = TickerPassed(t, TickerNow(), ahead - 1);
+            t->n += due;
+            s->ticks += due;
+            s->slept += due;
+            return due;
+        }
+    }
+
+    now = TickerNow();
+    late = now > deadline ? now - deadline : 0;
+    s->wakes++;
+    s->jitter += late;
+    s->jitter_sq += (double)late * late;
+    if (late > s->jitter_max)
+        s->jitter_max = late;
+
+    // The ticks due by now, those waited for and those after them
+    due = TickerPassed(t, now, ahead + t->catch_up);
+    t->n += due;
+    if (TickerDeadline(t, t->n) <= now)
+    {
+        // Still behind, what's left is dropped
+        s->skipped += (now - TickerDeadline(t, t->n)) * t->hz / 1000000000 + 1;
+        ticker_resume(t);
+    }
+
+    s->ticks += due;
+    s->slept += ahead - 1;
+    s->caught_up += due - ahead;
+    return due;
+}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,11 +7,12 @@
 #include <sys/select.h>
 #include <termios.h>
 
-struct termios org_termios, game_termios, raw_termios;
+struct termios org_termios, game_termios;
 
 void make_beep()
 {
     printf("\x07");
+    fflush(stdout);
 }
 
 void init_drawing()
@@ -34,6 +36,7 @@ void hide_cursor(int hide)
 void restore_terminal()
 {
     tcsetattr(0, TCSANOW, &org_termios);
+    printf("\033[0m"); // The colors of a theme
     clear_screen();
     hide_cursor(0);
 }
@@ -43,71 +46,33 @@ void init_game_terminal()
     tcgetattr(0, &org_termios);
     memcpy(&game_termios, &org_termios, sizeof(game_termios));
 
-    game_termios.c_lflag &= ~(ECHO|ICANON);
+    // Raw for the whole game: keys as they come, Return as 13, ^S as a
+    // key, and read() never waits (poll() does)
+    game_termios.c_lflag &= ~(ECHO|ICANON|IEXTEN);
+    game_termios.c_iflag &= ~(ICRNL|IXON);
+    game_termios.c_cc[VTIME] = 0;
+    game_termios.c_cc[VMIN] = 0;
     tcsetattr(0, TCSANOW, &game_termios);
 
-    memcpy(&raw_termios, &game_termios, sizeof(raw_termios));
-    raw_termios.c_cc[VTIME] = 0;
-    raw_termios.c_cc[VMIN] = 0;
-
     atexit(restore_terminal);
 
     clear_screen();
     hide_cursor(1);
 }
 
-void reset_raw_terminal()
-{
-    tcsetattr(0, TCSANOW, &game_termios);
-}
-
-void set_raw_terminal()
-{
-    cfmakeraw(&raw_termios);
-    tcsetattr(0, TCSANOW, &raw_termios);
-}
-
-int kbhit()
-{
-    struct timeval tv = {0L, 0L};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    return select(1, &fds, NULL, NULL, &tv);
-}
-
-int getch()
-{
-    int r;
-    unsigned char c;
-    if ((r = read(0, &c, sizeof(c))) < 0) {
-        return r;
-    } else {
-        return c;
-    }
-}
-
-int getkey()
-{
-    int key = -1;
-
-    if (kbhit())
-    {
-        set_raw_terminal();
-        key = getch();
-        reset_raw_terminal();
-    }
-
-    return key;
-}
-
 int nsleep(const struct timespec *req, struct timespec *rem)
 {
-    struct timespec temp_rem;
-    if (nanosleep(req, rem) == -1)
-        return nsleep(rem, &temp_rem);
-    else
-        return 1;
+    struct timespec left = *req;
+
+    // Interrupted by a signal, sleep what is left of it
+    while (nanosleep(&left, &left) == -1)
+        if (errno != EINTR)
+        {
+            if (rem != NULL)
+                *rem = left;
+            return 0;
+        }
+    return 1;
 }
 
 int Sleep(unsigned long milisec)
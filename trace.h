@@ -0,0 +1,384 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Trace: every frame sent to the terminal and every key of a session,
+ * written to a file by a thread of its own, so the game never waits for
+ * the disk. The game puts records in a ring which only it writes and the
+ * writer only reads (one producer, one consumer, no locks: each side
+ * publishes its end with a release store). The writer wakes every
+ * TRACE_PERIOD, turns what came into the format of the file, writes it
+ * in one go and syncs it every TRACE_SYNC. When the ring is full the
+ * record is dropped and counted, the game goes on.
+ *
+ * Formats:
+ *   TRACE_ASCIICAST: asciicast v2, a JSON header line, then a line
+ *                    [seconds, "o", bytes] a frame, [seconds, "i",
+ *                    bytes] a key (arrows as ESC [ A to D)
+ *   TRACE_BINARY:    "BTR1", then records of varints: nanoseconds since
+ *                    the last record, kind ('o' or 'i'), then for a
+ *                    frame its length and bytes, for a key the key
+ */
+
+#include <pthread.h>
+
+#define TRACE_RING          (1 << 20) // Bytes of records waiting, a power of two
+#define TRACE_OUT           65536     // Bytes written at once at most
+#define TRACE_PERIOD        20000000  // Nanoseconds the writer sleeps
+#define TRACE_SYNC          1000000000ULL // Nanoseconds between fsync()s
+#define TRACE_MAGIC         "BTR1"
+
+enum trace_format {TRACE_ASCIICAST, TRACE_BINARY};
+enum trace_kind {TRACE_FRAME = 'o', TRACE_KEY = 'i'};
+
+struct trace_stats
+{
+    unsigned long frames;     // Put in the ring
+    unsigned long keys;
+    unsigned long frames_dropped; // Lost to a full ring
+    unsigned long keys_dropped;
+    unsigned long long bytes; // Written to the file
+    unsigned long writes;
+    unsigned long syncs;
+    int error;                // The file can't be written, errno
+};
+
+// Before the bytes of every record in the ring
+struct trace_record
+{
+    uint32_t size;            // Bytes after the record
+    uint32_t kind;            // enum trace_kind
+    uint64_t ns;              // When, monotonic
+};
+
+struct trace
+{
+    int fd;                   // -1 when not tracing
+    int format;               // enum trace_format
+    unsigned char ring[TRACE_RING];
+    unsigned long long head;  // Written by the game only
+    unsigned long long tail;  // Written by the writer only
+    int stop;                 // Set by the game, the writer ends
+    pthread_t thread;
+    uint64_t start;           // Of the trace, monotonic
+    uint64_t last;            // Of the last record written out
+    uint64_t synced;          // When the file was last synced
+    int unsynced;             // Written since
+    unsigned char out[TRACE_OUT];
+    int len;
+    struct trace_stats stats;
+};
+
+
+uint64_t TraceNow(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/***********************************************
+ * Copy n bytes of the ring from pos, wrapping *
+ ***********************************************/
+void TraceCopyOut(struct trace *t, unsigned long long pos, void *data, size_t n)
+{
+    size_t at = pos % TRACE_RING;
+    size_t first = n < TRACE_RING - at ? n : TRACE_RING - at;
+
+    memcpy(data, t->ring + at, first);
+    memcpy((char*)data + first, t->ring, n - first);
+}
+
+
+void TraceCopyIn(struct trace *t, unsigned long long pos, const void *data, size_t n)
+{
+    size_t at = pos % TRACE_RING;
+    size_t first = n < TRACE_RING - at ? n : TRACE_RING - at;
+
+    memcpy(t->ring + at, data, first);
+    memcpy(t->ring, (const char*)data + first, n - first);
+}
+
+
+/****************************************************
+ * Put a record in the ring, -1 when it doesn't fit *
+ * (game side)                                      *
+ ****************************************************/
+int TracePush(struct trace *t, int kind, const void *data, size_t n)
+{
+    struct trace_record r;
+    unsigned long long tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+
+    if (t->head + sizeof(r) + n - tail > TRACE_RING)
+        return -1;
+    r.size = n;
+    r.kind = kind;
+    r.ns = TraceNow();
+    TraceCopyIn(t, t->head, &r, sizeof(r));
+    TraceCopyIn(t, t->head + sizeof(r), data, n);
+    __atomic_store_n(&t->head, t->head + sizeof(r) + n, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*******************************************************
+ * The frame just sent to the terminal, -1 when it was *
+ * dropped (the next one should be a whole one again)  *
+ *******************************************************/
+int trace_frame(struct trace *t, const char *data, int n)
+{
+    if (t->fd < 0)
+        return 0;
+    if (TracePush(t, TRACE_FRAME, data, n) < 0)
+    {
+        t->stats.frames_dropped++;
+        return -1;
+    }
+    t->stats.frames++;
+    return 0;
+}
+
+
+void trace_key(struct trace *t, int key)
+{
+    if (t->fd < 0)
+        return;
+    if (TracePush(t, TRACE_KEY, &key, sizeof(key)) < 0)
+        t->stats.keys_dropped++;
+    else
+        t->stats.keys++;
+}
+
+
+/*********************************************
+ * Write out what the writer has composed    *
+ * (writer side, as all down to trace_close) *
+ *********************************************/
+void TraceWrite(struct trace *t)
+{
+    unsigned char *p = t->out;
+    ssize_t n;
+
+    while (t->len > 0 && !t->stats.error)
+    {
+        n = write(t->fd, p, t->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            t->stats.error = errno; // Disk full or gone, nothing more is kept
+        else
+        {
+            p += n;
+            t->len -= n;
+            t->stats.bytes += n;
+        }
+    }
+    t->unsynced = 1;
+    t->stats.writes++;
+    t->len = 0;
+}
+
+
+void TraceOut(struct trace *t, const void *data, int n)
+{
+    if (t->len + n > TRACE_OUT)
+        TraceWrite(t);
+    memcpy(t->out + t->len, data, n);
+    t->len += n;
+}
+
+
+void TraceVarint(struct trace *t, unsigned long long v)
+{
+    unsigned char b[10];
+    int n = 0;
+
+    while (v >= 0x80)
+    {
+        b[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    TraceOut(t, b, n);
+}
+
+
+/************************************************************
+ * Bytes as the inside of a JSON string (UTF-8 stays as is) *
+ ************************************************************/
+void TraceJson(struct trace *t, const unsigned char *s, int n)
+{
+    char e[8];
+    int k;
+
+    for (k = 0; k < n; k++)
+        if (s[k] == '"' || s[k] == '\\')
+        {
+            e[0] = '\\';
+            e[1] = s[k];
+            TraceOut(t, e, 2);
+        } else if (s[k] < 0x20 || s[k] == 0x7F)
+        {
+            snprintf(e, sizeof(e), "\\u%04x", s[k]);
+            TraceOut(t, e, 6);
+        } else
+            TraceOut(t, s + k, 1);
+}
+
+
+/*********************************
+ * A key as the terminal sent it *
+ *********************************/
+int TraceKeyBytes(int key, unsigned char *b)
+{
+    if (key >= KEY_UP && key <= KEY_LEFT)
+    {
+        b[0] = 27;
+        b[1] = '[';
+        b[2] = 'A' + key - KEY_UP;
+        return 3;
+    }
+    b[0] = key;
+    return 1;
+}
+
+
+/********************************************
+ * Put the record in the format of the file *
+ ********************************************/
+void TraceFormat(struct trace *t, struct trace_record *r, const unsigned char *data)
+{
+    unsigned char key[4];
+    char txt[48];
+    int n;
+
+    if (t->format == TRACE_BINARY)
+    {
+        TraceVarint(t, r->ns - t->last);
+        TraceVarint(t, r->kind);
+        if (r->kind == TRACE_FRAME)
+        {
+            TraceVarint(t, r->size);
+            TraceOut(t, data, r->size);
+        } else
+            TraceVarint(t, *(const int*)data);
+    } else
+    {
+        n = snprintf(txt, sizeof(txt), "[%.6f, \"%c\", \"",
+            (r->ns - t->start) / 1e9, r->kind);
+        TraceOut(t, txt, n);
+        if (r->kind == TRACE_FRAME)
+            TraceJson(t, data, r->size);
+        else
+            TraceJson(t, key, TraceKeyBytes(*(const int*)data, key));
+        TraceOut(t, "\"]\n", 3);
+    }
+    t->last = r->ns;
+}
+
+
+/*************************************************************
+ * The writer: whatever came to the ring, out to the file in *
+ * one write, then a sleep; all of it before it ends         *
+ *************************************************************/
+void *TraceThread(void *arg)
+{
+    struct trace *t = arg;
+    struct timespec period = {0, TRACE_PERIOD};
+    struct trace_record r;
+    unsigned char *data = NULL, *grown;
+    unsigned long long head;
+    size_t room = 0;
+    int stop;
+
+    do
+    {
+        stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        while (t->tail < head)
+        {
+            TraceCopyOut(t, t->tail, &r, sizeof(r));
+            if (r.size > room && (grown = realloc(data, r.size)) != NULL)
+            {
+                data = grown;
+                room = r.size;
+            }
+            if (r.size <= room)
+            {
+                TraceCopyOut(t, t->tail + sizeof(r), data, r.size);
+                TraceFormat(t, &r, data);
+            }
+            __atomic_store_n(&t->tail, t->tail + sizeof(r) + r.size, __ATOMIC_RELEASE);
+        }
+        if (t->len > 0)
+            TraceWrite(t);
+        if (t->unsynced && (stop || TraceNow() - t->synced >= TRACE_SYNC))
+        {
+            fsync(t->fd);
+            t->stats.syncs++;
+            t->synced = TraceNow();
+            t->unsynced = 0;
+        }
+        if (!stop)
+            nanosleep(&period, NULL);
+    } while (!stop);
+
+    free(data);
+    return NULL;
+}
+
+
+/*****************************************************************
+ * Start tracing to the file at path, with the writer thread, -1 *
+ * on error                                                      *
+ *****************************************************************/
+int trace_open(struct trace *t, const char *path, int format)
+{
+    char txt[128];
+    int n;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0)
+        return -1;
+    t->format = format;
+    t->start = t->last = t->synced = TraceNow();
+
+    if (format == TRACE_BINARY)
+        TraceOut(t, TRACE_MAGIC, 4);
+    else
+    {
+        n = snprintf(txt, sizeof(txt), "{\"version\": 2, \"width\": %d, "
+            "\"height\": %d, \"timestamp\": %ld}\n", FRAME_WIDTH, FRAME_HIGH,
+            (long)time(NULL));
+        TraceOut(t, txt, n);
+    }
+
+    if (pthread_create(&t->thread, NULL, TraceThread, t))
+    {
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************
+ * Let the writer write out the rest and end, -1 when *
+ * the file couldn't be written                       *
+ ******************************************************/
+int trace_close(struct trace *t)
+{
+    if (t->fd < 0)
+        return 0;
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+    close(t->fd);
+    t->fd = -1;
+    return t->stats.error ? -1 : 0;
+}
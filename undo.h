@@ -0,0 +1,81 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Undo: snapshots of the world taken every UNDO_EVERY ticks into a ring
+ * allocated once, for the biggest level of the set. Taking one is a copy
+ * of the cells (a kilobyte on a 40x22 level), going back is a restore.
+ */
+
+#define UNDO_SLOTS          64      // Snapshots kept, half a minute back
+#define UNDO_EVERY          30      // Ticks between them
+#define UNDO_BYTES          (64 << 20) // Ring of the huge levels is shorter
+
+struct undo
+{
+    unsigned char *ring;  // slots snapshots, slot_size bytes each
+    size_t slot_size;
+    int slots;
+    int head;             // Slot to take the next snapshot into
+    int count;            // Snapshots kept
+};
+
+
+/**************************************************************
+ * Room for the snapshots of the biggest level, -1 on failure *
+ **************************************************************/
+int undo_init(struct undo *u, const struct level *l, int count)
+{
+    size_t cells = 0;
+    int k;
+
+    for (k = 0; k < count; k++)
+        if ((size_t)l[k].width * l[k].height > cells)
+            cells = (size_t)l[k].width * l[k].height;
+
+    memset(u, 0, sizeof(*u));
+    // Rounded up so that every slot starts aligned for a snapshot
+    u->slot_size = sizeof(struct snapshot) + cells;
+    u->slot_size = (u->slot_size + _Alignof(struct snapshot) - 1)
+                   / _Alignof(struct snapshot) * _Alignof(struct snapshot);
+    u->slots = UNDO_BYTES / u->slot_size;
+    if (u->slots > UNDO_SLOTS)
+        u->slots = UNDO_SLOTS;
+    if (u->slots < 2)
+        u->slots = 2;
+
+    u->ring = malloc(u->slots * u->slot_size);
+    return u->ring != NULL ? 0 : -1;
+}
+
+
+/**************************************
+ * Take the snapshot, when one is due *
+ **************************************/
+void undo_push(struct undo *u, unsigned long tick, struct world *w)
+{
+    if (u->ring == NULL || tick % UNDO_EVERY
+        || world_snapshot_size(w) > u->slot_size)
+        return;
+
+    world_snapshot(w, (struct snapshot*)(u->ring + u->head * u->slot_size));
+    u->head = (u->head + 1) % u->slots;
+    if (u->count < u->slots)
+        u->count++;
+}
+
+
+/******************************************************
+ * Go back to the last snapshot, -1 when none is left *
+ ******************************************************/
+int undo_pop(struct undo *u, struct world *w)
+{
+    if (u->count == 0)
+        return -1;
+
+    u->head = (u->head + u->slots - 1) % u->slots;
+    u->count--;
+    return world_restore(w, (struct snapshot*)(u->ring + u->head * u->slot_size));
+}
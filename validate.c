@@ -0,0 +1,584 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * Level validator: plays every level of the set with no terminal, many
+ * times over, under many seeds and input policies, and tells how the
+ * games ended. A game is a run of one level from its start, over when
+ * the player goes through the door, is killed or the time is out.
+ *
+ * The runs are dealt to the threads in blocks of the same level (so a
+ * thread loads a level once for a block); a thread out of runs steals
+ * the last ones of another thread's block. The deques are taken without
+ * locks: the owner pops from the bottom, thieves from the top, and only
+ * the last run left is fought over with a compare-and-swap.
+ */
+
+#include "world.h"
+#include "pack.h"
+#include "replay.h"
+#include <getopt.h>
+#include <pthread.h>
+
+#define VALIDATE_SEEDS      64  // Seeds a level is played with, every policy
+#define VALIDATE_EVERY      (INTER_TIME / 10) // Ticks between keys of a policy
+
+enum policy {POLICY_IDLE,   // No keys, the level must not kill a still player
+             POLICY_RANDOM, // A random key (or a dig, or none) every time
+             POLICY_WALK,   // Keeps going one way, turns now and then
+             POLICY_SCRIPT, // The keys of a replay (boulder-solve -o)
+             POLICIES};
+
+const char *PolicyNames[POLICIES] = {"idle", "random", "walk", "script"};
+
+// How a run ended: the causes of death (enum death), then these
+#define RUN_DONE            DEATHS
+#define RUN_STOPPED         (DEATHS + 1) // Played for longer than the time
+#define RUN_ENDS            (DEATHS + 2)
+
+const char *EndNames[RUN_ENDS] = {"", "rock", "box", "fly", "time out",
+                                  "key", "done", "stopped"};
+
+struct run
+{
+    int level;
+    int policy;
+    uint64_t seed;
+    int end;              // RUN_DONE, RUN_STOPPED or enum death
+    int used;             // Seconds of the time used
+    int diamonds;         // Picked up
+    unsigned long ticks;
+};
+
+/*
+ * Runs of a thread: its block of the runs, [top, bottom) still to be
+ * played. Indices only grow at the top and shrink at the bottom.
+ */
+struct deque
+{
+    int *run;
+    long top, bottom;
+};
+
+/*
+ * A level seen from its start: the diamonds on the board and the most
+ * a blast of every fly could add (none of the blasts overlapping)
+ */
+struct check
+{
+    int claimed;            // Counted, by the one worker which claimed it
+    int diamonds;
+    int flies;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    struct deque deque;
+    struct world *w;
+    struct world *start;  // The level of the last run, as loaded
+    unsigned long long ticks;
+    int stolen;
+};
+
+/********************
+ * Global variables *
+ ********************/
+struct level *Levels;
+int LevelsCount;
+int Threads;
+int Seeds = VALIDATE_SEEDS;
+unsigned long long Seed = WORLD_SEED;
+int Policies;             // A bit for every enum policy
+char *ScriptDir;
+struct replay_script *Scripts; // Of every level, n == 0 when there is none
+struct run *Runs;
+int RunsCount;
+struct check *Checks;
+struct worker *Workers;
+
+
+double Now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/*************************************************
+ * Random numbers of a policy (splitmix64), kept *
+ * apart from the generator of the world         *
+ *************************************************/
+uint64_t PolicyRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+/***************************************************
+ * Take a run from the bottom of the own deque, -1 *
+ * when it's empty                                 *
+ ***************************************************/
+int PopRun(struct deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    int k = -1;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    if (t < b)
+        return d->run[b];
+    if (t == b && __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        k = d->run[b]; // The last one, not taken by a thief
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_SEQ_CST);
+    return k;
+}
+
+
+/*****************************************************
+ * Take a run from the top of another deque, -1 when *
+ * it's empty or another thread was faster           *
+ *****************************************************/
+int StealRun(struct deque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    int k;
+
+    if (t >= b)
+        return -1;
+    k = d->run[t];
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+    return k;
+}
+
+
+/*****************************************************
+ * The next run for the thread, -1 when none is left *
+ *****************************************************/
+int NextRun(struct worker *wk)
+{
+    int k, v, tries;
+
+    k = PopRun(&wk->deque);
+    if (k >= 0)
+        return k;
+
+    // Go round the others until all of them are empty
+    do
+    {
+        tries = 0;
+        for (v = (wk->id + 1) % Threads; v != wk->id; v = (v + 1) % Threads)
+        {
+            struct deque *d = &Workers[v].deque;
+
+            while (__atomic_load_n(&d->top, __ATOMIC_SEQ_CST)
+                   < __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST))
+            {
+                tries++;
+                k = StealRun(d);
+                if (k >= 0)
+                {
+                    wk->stolen++;
+                    return k;
+                }
+            }
+        }
+    }
+    while (tries);
+    return -1;
+}
+
+
+/**********************************************************
+ * Count what the level has for the player, at its start, *
+ * unless another worker has claimed it first             *
+ **********************************************************/
+void CheckLevel(struct check *c, struct world *w)
+{
+    struct cell_list *l = &w->where[FLY];
+    int j, i, y, x, k, flies = 0, free = 0;
+
+    if (!__atomic_compare_exchange_n(&c->claimed, &free, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return; // Read once the workers are done
+
+    // A lost list (out of memory) gives no flies, a lower bound
+    for (k = 0; !l->lost && k < l->n; k++)
+    {
+        y = l->cell[k] / w->width;
+        x = l->cell[k] % w->width;
+        if (GetBoard(w, y, x) != FLY)
+            continue;
+        for (j = y - 1; j <= y + 1; j++)
+            for (i = x - 1; i <= x + 1; i++)
+                flies += GetBoard(w, j, i) != METAL
+                         && GetBoard(w, j, i) != DIAMOND;
+    }
+
+    c->diamonds = w->count[DIAMOND];
+    c->flies = flies;
+}
+
+
+/***************************************************
+ * Play the run on the thread's world, -1 when the *
+ * level doesn't fit in memory                     *
+ ***************************************************/
+int Play(struct worker *wk, struct run *r)
+{
+    const struct replay_script *script = &Scripts[r->level];
+    struct world *w = wk->w;
+    unsigned long tick, limit;
+    uint64_t v, random = r->seed ^ ((uint64_t)r->level << 32 | r->policy);
+    int left, n = 0, way = 0;
+
+    if (wk->start == NULL || wk->start->game.current_level != r->level)
+    {
+        if (wk->start != NULL)
+            world_destroy(wk->start);
+        wk->start = world_create_levels(Levels, LevelsCount, r->level);
+        if (wk->start == NULL || wk->start->game.current_level != r->level)
+            return -1; // Started over from the first level, see StartLevel()
+        CheckLevel(&Checks[r->level], wk->start);
+    }
+    if (world_copy(w, wk->start) < 0)
+        return -1;
+    world_seed(w, r->seed);
+
+    // Any run ends with the time, the limit is for the cheats of a script
+    limit = (unsigned long)(w->game.level_time + 2) * (INTER_TIME + 1);
+    left = w->game.time;
+    r->end = RUN_STOPPED;
+    for (tick = 0; tick < limit; tick++)
+    {
+        switch (r->policy)
+        {
+            case POLICY_SCRIPT:
+                for (; n < script->n && script->tick[n] <= tick; n++)
+                    world_key(w, script->key[n]);
+                break;
+            case POLICY_RANDOM:
+                if (tick % VALIDATE_EVERY)
+                    break;
+                v = PolicyRandom(&random);
+                if (v % 8 == 7)
+                    break; // Wait
+                if (v % 8 == 6)
+                    world_key(w, ' '); // Dig without moving
+                world_key(w, "wasd"[(v >> 8) % 4]);
+                break;
+            case POLICY_WALK:
+                if (tick % VALIDATE_EVERY)
+                    break;
+                if (PolicyRandom(&random) % 4 == 0)
+                    way = PolicyRandom(&random) % 4;
+                world_key(w, "wasd"[way]);
+                break;
+        }
+        if (w->game.hero_state == KILLED)
+            break;
+
+        left = w->game.time;
+        r->ticks++;
+        if (world_step(w) & WORLD_LEVEL_DONE)
+        {
+            r->end = RUN_DONE;
+            r->diamonds = w->levels[r->level].diamonds;
+            break;
+        }
+        if (w->game.hero_state == KILLED)
+            break;
+    }
+    if (r->end != RUN_DONE)
+    {
+        r->diamonds = w->game.level_diamonds - w->game.diamonds;
+        if (w->game.hero_state == KILLED)
+            r->end = w->death != DEATH_NONE ? w->death : DEATH_TIME;
+    }
+    r->used = w->levels[r->level].time - left;
+    wk->ticks += r->ticks;
+    return 0;
+}
+
+
+void *ValidateThread(void *arg)
+{
+    struct worker *wk = arg;
+    int k;
+
+    while ((k = NextRun(wk)) >= 0)
+        if (Play(wk, &Runs[k]) < 0)
+            Runs[k].end = -1;
+    return NULL;
+}
+
+
+/*************************************************************
+ * Print what the runs of the level did, 1 when the diamonds *
+ * it wants can't be had; nothing when it had no runs        *
+ *************************************************************/
+int Report(int level)
+{
+    const struct level *l = &Levels[level];
+    const struct check *c = &Checks[level];
+    int count[POLICIES][RUN_ENDS], done[POLICIES], best = 0;
+    long long used[POLICIES];
+    int most[POLICIES], least[POLICIES];
+    int k, p, e, runs, failed = 0, shown = 0;
+    const char *can;
+
+    memset(count, 0, sizeof(count));
+    memset(done, 0, sizeof(done));
+    memset(used, 0, sizeof(used));
+    memset(most, 0, sizeof(most));
+    for (p = 0; p < POLICIES; p++)
+        least[p] = l->time;
+
+    for (k = 0; k < RunsCount; k++)
+    {
+        const struct run *r = &Runs[k];
+
+        if (r->level != level)
+            continue;
+        if (r->end < 0)
+        {
+            failed++;
+            continue;
+        }
+        count[r->policy][r->end]++;
+        if (r->diamonds > best)
+            best = r->diamonds;
+        if (r->end != RUN_DONE)
+            continue;
+        done[r->policy]++;
+        used[r->policy] += r->used;
+        if (r->used > most[r->policy])
+            most[r->policy] = r->used;
+        if (r->used < least[r->policy])
+            least[r->policy] = r->used;
+        shown = 1;
+    }
+
+    if (!c->claimed)
+    {
+        if (failed)
+            printf("level %2d: not played, out of memory\n", level + 1);
+        return 0; // No runs, or none could load it
+    }
+    if (shown || c->diamonds >= l->diamonds)
+        can = "yes";
+    else if (c->diamonds + c->flies >= l->diamonds)
+        can = "with flies";
+    else
+        can = "no";
+    printf("level %2d: %dx%d, %d diamonds in %d s; on the board %d, from "
+        "flies up to %d, achievable %s, most picked up %d\n", level + 1,
+        l->width, l->height, l->diamonds, l->time, c->diamonds, c->flies,
+        can, best);
+    if (failed)
+        printf("    %d runs not played, out of memory\n", failed);
+
+    for (p = 0; p < POLICIES; p++)
+    {
+        if (!(Policies & 1 << p) || (p == POLICY_SCRIPT && Scripts[level].n == 0))
+            continue;
+        for (runs = 0, e = 0; e < RUN_ENDS; e++)
+            runs += count[p][e];
+        if (runs == 0)
+            continue;
+        printf("    %-6s %4d runs, done %5.1f%%", PolicyNames[p], runs,
+            100.0 * done[p] / runs);
+        if (done[p])
+            printf(" in %d..%d s (mean %.0f) of %d", least[p], most[p],
+                (double)used[p] / done[p], l->time);
+        for (e = DEATH_ROCK; e < RUN_ENDS; e++)
+            if (e != RUN_DONE && count[p][e])
+                printf(", %s %d", EndNames[e], count[p][e]);
+        printf("\n");
+    }
+    return can[0] == 'n';
+}
+
+
+/*****************************************************************
+ * Turn the comma separated names into bits of Policies, -1 when *
+ * one is unknown                                                *
+ *****************************************************************/
+int ParsePolicies(char *names)
+{
+    char *name;
+    int p;
+
+    Policies = 0;
+    for (name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        for (p = 0; p < POLICIES && strcmp(name, PolicyNames[p]); p++)
+            ;
+        if (p == POLICIES)
+            return -1;
+        Policies |= 1 << p;
+    }
+    return Policies ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char path[4096];
+    int opt, k, p, s, level, first = 0, last = -1, broken = 0;
+    unsigned long long ticks = 0;
+    double t0, sec;
+
+    Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    Policies = 1 << POLICY_IDLE | 1 << POLICY_RANDOM | 1 << POLICY_WALK;
+    while ((opt = getopt(argc, argv, "L:l:j:n:s:p:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'L':
+                Levels = world_open_pack(optarg, &LevelsCount);
+                if (Levels == NULL)
+                    Levels = world_read_levels(optarg, &LevelsCount);
+                if (Levels == NULL)
+                {
+                    fprintf(stderr, "%s: can't read levels from %s\n",
+                        argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                first = last = atoi(optarg) - 1;
+                break;
+            case 'j':
+                Threads = atoi(optarg);
+                break;
+            case 'n':
+                Seeds = atoi(optarg);
+                break;
+            case 's':
+                Seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'p':
+                if (ParsePolicies(optarg) < 0)
+                {
+                    fprintf(stderr, "%s: policies are idle, random, walk "
+                        "and script\n", argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                ScriptDir = optarg;
+                Policies |= 1 << POLICY_SCRIPT;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-L levels] [-l level] [-j threads] "
+                    "[-n seeds] [-s first seed] [-p policy,...] "
+                    "[-r replay dir]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (Levels == NULL)
+    {
+        Levels = (struct level*)BuiltinLevels();
+        LevelsCount = LEVELS_NUMBERS;
+    }
+    if (last < 0)
+        last = LevelsCount - 1;
+    if (first < 0 || last >= LevelsCount)
+    {
+        fprintf(stderr, "%s: there are %d levels\n", argv[0], LevelsCount);
+        return 1;
+    }
+    if (Threads < 1)
+        Threads = 1;
+    if (Seeds < 1)
+        Seeds = 1;
+
+    // Scripts are the replays written by boulder-solve -o
+    Scripts = calloc(LevelsCount, sizeof(struct replay_script));
+    Checks = calloc(LevelsCount, sizeof(struct check));
+    Runs = calloc((size_t)(last - first + 1) * POLICIES * Seeds, sizeof(struct run));
+    Workers = calloc(Threads, sizeof(struct worker));
+    if (Scripts == NULL || Checks == NULL || Runs == NULL || Workers == NULL)
+    {
+        fprintf(stderr, "%s: no memory\n", argv[0]);
+        return 1;
+    }
+    for (level = first; ScriptDir != NULL && level <= last; level++)
+    {
+        snprintf(path, sizeof(path), "%s/level-%02d.brp", ScriptDir, level + 1);
+        if (replay_script(&Scripts[level], path) == 0
+            && Scripts[level].level != level)
+            replay_script_free(&Scripts[level]); // Not a game of this level
+    }
+
+    for (level = first; level <= last; level++)
+        for (p = 0; p < POLICIES; p++)
+        {
+            if (!(Policies & 1 << p)
+                || (p == POLICY_SCRIPT && Scripts[level].n == 0))
+                continue;
+            for (s = 0; s < Seeds; s++)
+            {
+                Runs[RunsCount].level = level;
+                Runs[RunsCount].policy = p;
+                Runs[RunsCount++].seed = Seed + s;
+            }
+        }
+
+    // Every thread gets its block of runs, in the order of the levels
+    for (k = 0; k < Threads; k++)
+    {
+        struct deque *d = &Workers[k].deque;
+        long from = (long)RunsCount * k / Threads;
+        long to = (long)RunsCount * (k + 1) / Threads;
+
+        Workers[k].id = k;
+        Workers[k].w = world_create_levels(Levels, LevelsCount, first);
+        d->run = malloc((to - from + 1) * sizeof(int));
+        if (Workers[k].w == NULL || d->run == NULL)
+        {
+            fprintf(stderr, "%s: no memory\n", argv[0]);
+            return 1;
+        }
+        // Popped from the bottom, the first run of the block goes last
+        for (d->bottom = 0; from + d->bottom < to; d->bottom++)
+            d->run[d->bottom] = to - 1 - d->bottom;
+    }
+
+    t0 = Now();
+    for (k = 0; k < Threads; k++)
+        pthread_create(&Workers[k].thread, NULL, ValidateThread, &Workers[k]);
+    for (k = 0; k < Threads; k++)
+    {
+        pthread_join(Workers[k].thread, NULL);
+        ticks += Workers[k].ticks;
+    }
+    sec = Now() - t0;
+
+    for (level = first; level <= last; level++)
+        broken += Report(level);
+    printf("played %d runs of %d levels with %d threads in %.1f s, %.0f ticks/s",
+        RunsCount, last - first + 1, Threads, sec, sec > 0 ? ticks / sec : 0);
+    for (k = 0, s = 0; k < Threads; k++)
+        s += Workers[k].stolen;
+    printf(", %d stolen\n", s);
+    if (broken)
+        printf("%d levels want more diamonds than can be had\n", broken);
+    return broken ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+/*
+ * boulder-watch: shows on this terminal the game of a boulder started
+ * with --broadcast socket, frame by frame as the game sends them (see
+ * broadcast.h). q leaves, the game goes on.
+ */
+
+#include "tools.h"
+#include "world.h"
+#include "render.h"
+#include "broadcast.h"
+#include <getopt.h>
+#include <poll.h>
+
+#define WATCH_BUFFER        (2 * BROADCAST_MESSAGE)
+
+
+/********************
+ * Global variables *
+ ********************/
+struct renderer Screen;
+int ShowStats = 0;        // Print the stream statistics on exit
+const struct render_theme *Theme = RenderThemes; // Glyphs and colors of the tiles
+unsigned char Buffer[WATCH_BUFFER]; // Bytes of messages not whole yet
+int Length;
+unsigned long Frames, Keyframes;
+unsigned long long Bytes;
+
+
+/***************************************
+ * Print the stream statistics on exit *
+ ***************************************/
+void PrintStats(void)
+{
+    if (!ShowStats)
+        return;
+    fprintf(stderr, "frames: %lu, keyframes: %lu, %llu bytes\n", Frames,
+        Keyframes, Bytes);
+}
+
+
+/*****************************************
+ * Connect to the game, -1 when it can't *
+ *****************************************/
+int Connect(const char *path)
+{
+    struct sockaddr_un a;
+    int fd;
+
+    if (strlen(path) >= sizeof(a.sun_path))
+        return -1;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/***********************************************************
+ * Put the message (the rest after the head) on the screen *
+ * to be flushed, -1 when it's not one this build knows    *
+ ***********************************************************/
+int Apply(int kind, const unsigned char *p, int n)
+{
+    const unsigned char *end = p + n;
+    int y, x, k;
+
+    if (kind == BROADCAST_KEYFRAME)
+    {
+        if (n != 2 + FRAME_HIGH * FRAME_WIDTH || p[0] != FRAME_HIGH
+            || p[1] != FRAME_WIDTH)
+            return -1;
+        memcpy(Screen.next, p + 2, FRAME_HIGH * FRAME_WIDTH);
+        Keyframes++;
+        return 0;
+    }
+    if (kind != BROADCAST_DELTA)
+        return -1;
+
+    while (p < end)
+    {
+        if (end - p < 3)
+            return -1;
+        y = p[0];
+        x = p[1];
+        k = p[2];
+        p += 3;
+        if (y >= FRAME_HIGH || x + k > FRAME_WIDTH || k > end - p)
+            return -1;
+        memcpy(&Screen.next[y][x], p, k);
+        p += k;
+    }
+    Frames++;
+    return 0;
+}
+
+
+/****************************************************************
+ * Apply the whole messages in the buffer and keep the rest for *
+ * the next read, -1 on a message this build doesn't know       *
+ ****************************************************************/
+int TakeMessages(void)
+{
+    unsigned char *p = Buffer;
+    int n;
+
+    while (Buffer + Length - p >= BROADCAST_HEAD)
+    {
+        n = p[1] | p[2] << 8;
+        if (BROADCAST_HEAD + n > (int)sizeof(Buffer))
+            return -1;
+        if (Buffer + Length - p < BROADCAST_HEAD + n)
+            break;
+        if (Apply(p[0], p + BROADCAST_HEAD, n) < 0)
+            return -1;
+        p += BROADCAST_HEAD + n;
+    }
+    Length -= p - Buffer;
+    memmove(Buffer, p, Length);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct pollfd p[2];
+    unsigned char key;
+    int opt, fd, n;
+
+    while ((opt = getopt(argc, argv, "St:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'S':
+                ShowStats = 1;
+                break;
+            case 't':
+                Theme = render_find_theme(optarg);
+                if (Theme == NULL)
+                {
+                    fprintf(stderr, "%s: unknown theme %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-S] [-t theme] socket\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-S] [-t theme] socket\n", argv[0]);
+        return 1;
+    }
+
+    fd = Connect(argv[optind]);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: no game on %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+
+    atexit(PrintStats); // Registered first, runs after terminal restore
+    init_game_terminal();
+    render_init(&Screen, Theme);
+
+    p[0].fd = fd;
+    p[1].fd = 0;
+    p[0].events = p[1].events = POLLIN;
+    while (1)
+    {
+        if (poll(p, 2, -1) < 0)
+            continue; // A signal
+
+        if (p[1].revents)
+        {
+            n = read(0, &key, 1);
+            if (n == 1 && key == 'q')
+                return 0;
+            if (n == 0)
+                p[1].fd = -1; // No keys, watched to the end of the game
+        }
+
+        if (p[0].revents)
+        {
+            n = read(fd, Buffer + Length, sizeof(Buffer) - Length);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return 0; // The game is over
+            Length += n;
+            Bytes += n;
+            if (TakeMessages() < 0)
+            {
+                fprintf(stderr, "%s: not a stream of this build\n", argv[0]);
+                return 1;
+            }
+            render_flush(&Screen);
+        }
+    }
+}
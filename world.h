@@ -0,0 +1,1886 @@
+/*
+ * Boulder Palm
+ * Copyright (C) 2001-2020 by Wojciech Martusewicz
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "levels.h"
+
+#define INTER_TIME          60
+#define TILES               16  // Tiles a cell can hold (CELL_TILE)
+#define LEVEL_MAX           16384 // Cells on a side of the biggest level
+#define WORLD_SEED          1     // Seed of a new world, see world_seed()
+
+/*
+ * The board is kept in square chunks, row after row of them, so a level
+ * takes as many chunks as it needs and the cells close on the board are
+ * close in memory. A row of a chunk is one 64 bit word of a bitplane.
+ */
+#define CHUNK_BITS          6
+#define CHUNK_SIZE          64  // 1 << CHUNK_BITS, the bits of a word
+#define CHUNK_MASK          (CHUNK_SIZE - 1)
+
+enum tile {TUNNEL, WALL, HERO, ROCK, DIAMOND, GROUND, METAL, BOX, DOOR, FLY,
+           CRASH};
+enum hero {KILLED, FACE1, FACE2, RIGHT, LEFT};
+enum sound {SOUND_NONE, SOUND_MOVE, SOUND_DIAMOND, SOUND_EXPLOSION};
+enum direction {NORTH, EAST, SOUTH, WEST};
+enum move {REAL, GHOST};
+enum box_state {STILL, MOVING};
+enum side {FALL_LEFT = -1, FALL_RIGHT = 1};
+enum phase {PHASE_CRASH, PHASE_ROCKS, PHASE_BOXES, PHASES}; // Of world_step()
+enum key {KEY_UP = 0x100, KEY_DOWN, KEY_RIGHT, KEY_LEFT}; // ESC [ A to D
+enum death {DEATH_NONE, DEATH_ROCK, DEATH_BOX, DEATH_FLY, DEATH_TIME, DEATH_KEY,
+            DEATHS};
+
+struct game
+{
+    int current_level;
+    int level_diamonds;   // Total number of diamonds to pick up
+    int level_time;       // Total time to pass the board
+    int diamonds;         // Diamonds left
+    int time;             // Time left
+    enum hero hero_state; // Direction of player
+    enum move move_mode;  // Move mode (real move or action without move)
+    int lastposx, lastposy;
+    int move_time;        // Time of last move (impatience feature)
+    int sound_mode;
+    enum sound sound_to_play;
+};
+
+/*
+ * A cell of the board is one byte: the tile in the low four bits, then
+ * the rock move flag, the box move flag and two bits of box direction.
+ * The rock kernels read the bytes directly and rely on this layout.
+ */
+#define CELL_TILE           0x0F
+#define CELL_ROCK_MOVE      0x10
+#define CELL_BOX_MOVE       0x20
+#define CELL_BOX_DIR        0xC0
+#define CELL_BOX_DIR_SHIFT  6
+
+/*
+ * Positions (h * width + x) of the cells which got one kind of
+ * tile. Entries are not removed when the tile goes away, they are
+ * skipped when read and dropped when the list is compacted.
+ */
+struct cell_list
+{
+    int *cell;
+    int n, size;
+    int lost;             // Out of memory, the list can't be trusted
+};
+
+/*
+ * Bitplanes of the board, a bit per cell, kept along with the bytes by
+ * the setters so the rock step can test whole rows at once.
+ */
+enum plane {PLANE_ROCK,      // Rocks and diamonds, the falling tiles
+            PLANE_TUNNEL,    // Empty space
+            PLANE_SUPPORT,   // Tiles the falling ones roll down from
+            PLANE_ENEMY,     // Boxes and flies
+            PLANE_MOVING,    // Rock move flag
+            PLANES};
+
+struct chunk
+{
+    unsigned char mem[CHUNK_SIZE][CHUNK_SIZE];
+    uint64_t plane[PLANES][CHUNK_SIZE];
+};
+
+/*
+ * A level to play. Cells are '0' + tile, row after row, stride bytes
+ * from the start of a row to the next one, or when there are no cells,
+ * packed two a byte (see pack.h).
+ */
+struct level
+{
+    int width, height;
+    int diamonds;         // Diamonds to pick up
+    int time;             // Time to pass the board
+    const char *cells;
+    int stride;
+    const unsigned char *packed;
+};
+
+/*
+ * The board as it was when the level was loaded, so the level can be
+ * started again with a copy instead of loading it cell by cell.
+ */
+struct board_copy
+{
+    int level;            // Level of the copy, -1 when there is none
+    struct chunk *chunk;
+    uint64_t *awake, *awake_rows;
+    int count[TILES];
+    struct cell_list where[TILES];
+    uint64_t hash;
+};
+
+// Tiles with their positions indexed, the rest have only the count
+#define INDEXED_TILES       ((1 << HERO) | (1 << DOOR) | (1 << BOX) \
+                             | (1 << FLY) | (1 << CRASH))
+
+/*
+ * One independent simulation. Everything the engine touches lives here,
+ * so any number of worlds can be stepped side by side (one per thread).
+ */
+struct world
+{
+    struct game game;
+    const struct level *levels; // Levels to play (not owned)
+    int levels_count;
+    int width, height;    // Size of the current level
+    int chunks_x, chunks_y;
+    struct chunk *chunk;  // Board, chunks_x chunks a row of chunks
+    int refresh_timer;    // Ticks left to the next move of objects
+    int time_timer;       // Ticks left to the next second
+    int count[TILES];     // Number of cells of each tile on the board
+    struct cell_list where[TILES]; // Positions of the INDEXED_TILES
+    struct cell_list moved;        // Cells of boxes and flies set MOVING
+    struct cell_list order;        // Boxes and flies in the board order
+    struct board_copy start;       // The last level loaded
+    uint64_t *awake;      // Rocks and diamonds which may move on the
+                          // next tick, chunks_x words a row
+    uint64_t *awake_rows; // Rows with any of them awake, a bit a row
+    uint64_t random;      // State of the random generator, never 0
+    uint64_t hash;        // Of the cell bytes, kept by every write to them
+    int death;            // What blew the player up: enum death
+    int dirty;            // WORLD_DIRTY_* seen since the caller cleared it
+    uint64_t *phase_ns;   // Time of every enum phase is added there,
+                          // when not NULL
+    int kernel;           // Rock candidates from: enum rock_kernel
+    int verify;           // Check the kernel against the scalar one, every
+                          // mask and every board
+    struct world *twin;   // Stepped with the scalar kernel, when verifying
+};
+
+/*
+ * The whole state of a world, to be put back by world_restore(): the game,
+ * the clocks, the random generator and the cell bytes, row after row.
+ * world_snapshot_size() gives the bytes it takes on the current level.
+ */
+struct snapshot
+{
+    struct game game;
+    int refresh_timer;
+    int time_timer;
+    uint64_t random;
+    int width, height;
+    unsigned char cells[];
+};
+
+/*
+ * A world at a tick in a few numbers, to tell apart two runs of a game
+ * or two states of a search: equal worlds have equal digests.
+ */
+struct world_digest
+{
+    uint64_t hash;        // Zobrist hash of the cell bytes (world.hash)
+    int diamonds;         // Left to pick up
+    int time;             // Seconds left
+};
+
+enum rock_kernel {KERNEL_AUTO, KERNEL_PLANES, KERNEL_SCALAR, KERNEL_SSE2,
+                  KERNEL_AVX2, KERNELS};
+
+// Planes of every tile (the moving plane is set by SetRockMove)
+const unsigned char TilePlanes[TILES] =
+{
+    [TUNNEL]  = 1 << PLANE_TUNNEL,
+    [WALL]    = 1 << PLANE_SUPPORT,
+    [ROCK]    = (1 << PLANE_ROCK) | (1 << PLANE_SUPPORT),
+    [DIAMOND] = (1 << PLANE_ROCK) | (1 << PLANE_SUPPORT),
+    [METAL]   = 1 << PLANE_SUPPORT,
+    [BOX]     = 1 << PLANE_ENEMY,
+    [DOOR]    = 1 << PLANE_SUPPORT,
+    [FLY]     = 1 << PLANE_ENEMY,
+};
+
+#include "kernels.h"
+
+/* Events reported by world_step() */
+#define WORLD_REFRESH       1  // Objects have moved, redraw the view
+#define WORLD_GAME_OVER     2  // Time is out
+#define WORLD_LEVEL_DONE    4  // Player went through the door, next level set
+
+/* What has changed of what the player sees, in world.dirty */
+#define WORLD_DIRTY_VIEW    1  // A tile of the board, or the player's place
+#define WORLD_DIRTY_STATUS  2  // Level, diamonds, time or sound mode
+#define WORLD_DIRTY_ALL     3
+
+#define WORLD_QUIET_MAX     (INTER_TIME * 60) // See world_quiet()
+
+
+/*********************************************
+ * Access (get/set) to game board properties *
+ *********************************************/
+struct chunk *ChunkOf(struct world *w, int h, int k)
+{
+    return &w->chunk[(h >> CHUNK_BITS) * w->chunks_x + k];
+}
+
+
+unsigned char *Cell(struct world *w, int h, int x)
+{
+    return &ChunkOf(w, h, x >> CHUNK_BITS)->mem[h & CHUNK_MASK][x & CHUNK_MASK];
+}
+
+
+/*****************************************************************
+ * Zobrist key of the cell byte, mixed from where it is and what *
+ * it holds; the board hash is the xor of the keys of its cells  *
+ * and a bare tunnel (0) adds nothing, so a clear board hashes 0 *
+ *****************************************************************/
+uint64_t CellKey(int h, int x, int v)
+{
+    uint64_t z = (uint64_t)h << 32 | (uint64_t)x << 8 | v;
+
+    if (v == 0)
+        return 0;
+    z += 0x9E3779B97F4A7C15ULL; // splitmix64
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+/**************************************************
+ * Every write to a cell byte comes through here, *
+ * the hash follows it                            *
+ **************************************************/
+void PutCell(struct world *w, int h, int x, unsigned char *cell, int v)
+{
+    if (*cell == v)
+        return;
+    w->hash ^= CellKey(h, x, *cell) ^ CellKey(h, x, v);
+    if ((*cell ^ v) & CELL_TILE)
+        w->dirty |= WORLD_DIRTY_VIEW;
+    *cell = v;
+}
+
+
+void SetPlane(struct world *w, int p, int h, int x, int v)
+{
+    uint64_t *word = &ChunkOf(w, h, x >> CHUNK_BITS)->plane[p][h & CHUNK_MASK];
+
+    if (v)
+        *word |= 1ULL << (x & CHUNK_MASK);
+    else
+        *word &= ~(1ULL << (x & CHUNK_MASK));
+}
+
+
+int GetBoard(struct world *w, int h, int x)
+{
+    // Beyond the edges is as solid as the metal border
+    if ((unsigned)h >= (unsigned)w->height || (unsigned)x >= (unsigned)w->width)
+        return METAL;
+    return *Cell(w, h, x) & CELL_TILE;
+}
+
+
+/*****************************************************
+ * Rock or diamond in this cell may have to move now *
+ *****************************************************/
+void Wake(struct world *w, int h, int x)
+{
+    if (h > 0 && h < w->height - 1 && x > 0 && x < w->width - 1)
+    {
+        w->awake[h * w->chunks_x + (x >> CHUNK_BITS)] |= 1ULL << (x & CHUNK_MASK);
+        w->awake_rows[h / 64] |= 1ULL << (h % 64);
+    }
+}
+
+
+/*************************************************
+ * The cell has changed, wake up rocks around it *
+ *************************************************/
+void WakeAround(struct world *w, int h, int x)
+{
+    int j, i;
+
+    // Rocks fall into the cell below and roll over the cells aside
+    for (j = h - 1; j <= h; j++)
+        for (i = x - 1; i <= x + 1; i++)
+            Wake(w, j, i);
+}
+
+
+/***************************************
+ * Sort helper for the list compacting *
+ ***************************************/
+int CompareCells(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+
+/***********************************************
+ * Drop the stale and repeated cells of a list *
+ ***********************************************/
+void CompactCells(struct world *w, int tile)
+{
+    struct cell_list *l = &w->where[tile];
+    int k, n = 0;
+
+    qsort(l->cell, l->n, sizeof(int), CompareCells);
+    for (k = 0; k < l->n; k++)
+        if ((n == 0 || l->cell[n - 1] != l->cell[k])
+            && GetBoard(w, l->cell[k] / w->width,
+                        l->cell[k] % w->width) == tile)
+            l->cell[n++] = l->cell[k];
+    l->n = n;
+}
+
+
+/****************************
+ * Make room for more cells *
+ ****************************/
+void GrowCells(struct cell_list *l)
+{
+    int *c = realloc(l->cell, (l->size * 2 + 8) * sizeof(int));
+
+    if (c == NULL)
+    {
+        l->lost = 1;
+        return;
+    }
+    l->cell = c;
+    l->size = l->size * 2 + 8;
+}
+
+
+/*******************************
+ * Append the cell to the list *
+ *******************************/
+void PushCell(struct cell_list *l, int cell)
+{
+    if (l->n == l->size && !l->lost)
+        GrowCells(l);
+    if (l->lost)
+        return;
+    l->cell[l->n++] = cell;
+}
+
+
+/**********************************
+ * Remember the cell got the tile *
+ **********************************/
+void AddCell(struct world *w, int tile, int cell)
+{
+    struct cell_list *l = &w->where[tile];
+
+    if (l->n == l->size && !l->lost)
+    {
+        // Compact first, grow only if most of the entries are alive
+        CompactCells(w, tile);
+        if (l->n * 2 >= l->size)
+            GrowCells(l);
+    }
+    PushCell(l, cell);
+}
+
+
+/******************************************
+ * Cells of the word k which are on board *
+ ******************************************/
+uint64_t WordCells(struct world *w, int k)
+{
+    int n = w->width - k * 64;
+
+    if (n <= 0)
+        return 0;
+    return (n < 64) ? (1ULL << n) - 1 : ~0ULL;
+}
+
+
+/****************************************
+ * Room for the board of the given size *
+ ****************************************/
+int ResizeBoard(struct world *w, int width, int height)
+{
+    int cx = (width + CHUNK_MASK) >> CHUNK_BITS;
+    int cy = (height + CHUNK_MASK) >> CHUNK_BITS;
+    struct chunk *chunk;
+    uint64_t *awake, *rows;
+
+    if (width == w->width && height == w->height)
+        return 0;
+
+    chunk = malloc((size_t)cx * cy * sizeof(struct chunk));
+    awake = malloc((size_t)cx * height * sizeof(uint64_t));
+    rows = malloc((height + 63) / 64 * sizeof(uint64_t));
+    if (chunk == NULL || awake == NULL || rows == NULL)
+    {
+        // Keep playing on the old board
+        free(chunk);
+        free(awake);
+        free(rows);
+        return -1;
+    }
+
+    free(w->chunk);
+    free(w->awake);
+    free(w->awake_rows);
+    w->chunk = chunk;
+    w->awake = awake;
+    w->awake_rows = rows;
+    w->chunks_x = cx;
+    w->chunks_y = cy;
+    w->width = width;
+    w->height = height;
+    return 0;
+}
+
+
+/***************************************
+ * Forget the whole board (all tunnel) *
+ ***************************************/
+void ResetIndex(struct world *w)
+{
+    int t, j, k;
+
+    for (t = 0; t < TILES; t++)
+    {
+        w->count[t] = 0;
+        w->where[t].n = 0;
+        w->where[t].lost = 0;
+    }
+    w->count[TUNNEL] = w->width * w->height;
+    w->moved.n = 0;
+    w->moved.lost = 0;
+    memset(w->awake, 0, (size_t)w->chunks_x * w->height * sizeof(uint64_t));
+    memset(w->awake_rows, 0, (w->height + 63) / 64 * sizeof(uint64_t));
+
+    memset(w->chunk, 0, (size_t)w->chunks_x * w->chunks_y * sizeof(struct chunk));
+    w->hash = 0;
+    for (j = 0; j < w->height; j++)
+        for (k = 0; k < w->chunks_x; k++)
+            ChunkOf(w, j, k)->plane[PLANE_TUNNEL][j & CHUNK_MASK] = WordCells(w, k);
+}
+
+
+void SetBoard(struct world *w, int h, int x, int v)
+{
+    unsigned char *cell;
+    int old, p, changed;
+
+    if ((unsigned)h >= (unsigned)w->height || (unsigned)x >= (unsigned)w->width)
+        return;
+    cell = Cell(w, h, x);
+    old = *cell & CELL_TILE;
+    if (old == v)
+        return;
+
+    changed = TilePlanes[old] ^ TilePlanes[v];
+    for (p = 0; changed; p++, changed >>= 1)
+        if (changed & 1)
+            SetPlane(w, p, h, x, TilePlanes[v] & (1 << p));
+
+    w->count[old]--;
+    w->count[v]++;
+    PutCell(w, h, x, cell, (*cell & ~CELL_TILE) | v);
+
+    if (INDEXED_TILES & (1 << v))
+        AddCell(w, v, h * w->width + x);
+    WakeAround(w, h, x);
+}
+
+int GetRockMove(struct world *w, int h, int x)
+{
+    return (*Cell(w, h, x) & CELL_ROCK_MOVE) != 0;
+}
+
+void SetRockMove(struct world *w, int h, int x, int v)
+{
+    unsigned char *cell = Cell(w, h, x);
+
+    PutCell(w, h, x, cell, v ? *cell | CELL_ROCK_MOVE : *cell & ~CELL_ROCK_MOVE);
+    SetPlane(w, PLANE_MOVING, h, x, v);
+    if (v == MOVING)
+        Wake(w, h, x);
+}
+
+int GetBoxMove(struct world *w, int h, int x)
+{
+    return (*Cell(w, h, x) & CELL_BOX_MOVE) != 0;
+}
+
+void SetBoxMove(struct world *w, int h, int x, int v)
+{
+    unsigned char *cell = Cell(w, h, x);
+
+    PutCell(w, h, x, cell, v ? *cell | CELL_BOX_MOVE : *cell & ~CELL_BOX_MOVE);
+    if (v == MOVING)
+        PushCell(&w->moved, h * w->width + x);
+}
+
+int GetBoxDir(struct world *w, int h, int x)
+{
+    return (*Cell(w, h, x) & CELL_BOX_DIR) >> CELL_BOX_DIR_SHIFT;
+}
+
+void SetBoxDir(struct world *w, int h, int x, int v)
+{
+    unsigned char *cell = Cell(w, h, x);
+
+    PutCell(w, h, x, cell,
+            (*cell & ~CELL_BOX_DIR) | ((v << CELL_BOX_DIR_SHIFT) & CELL_BOX_DIR));
+}
+
+
+/***********************************
+ * Tile of the level cell, decoded *
+ ***********************************/
+int LevelTile(const struct level *l, int j, int i)
+{
+    long long c;
+    int t;
+
+    if (l->cells != NULL)
+    {
+        t = l->cells[j * l->stride + i] - 48;
+    } else
+    {
+        c = (long long)j * l->width + i;
+        t = (l->packed[c / 2] >> (c % 2 * 4)) & 0x0F;
+    }
+    return (t >= 0 && t <= CRASH) ? t : METAL; // Nothing unknown gets in
+}
+
+
+/****************************************
+ * Copy the list, -1 when it can't grow *
+ ****************************************/
+int CopyCells(struct cell_list *to, const struct cell_list *from)
+{
+    int *c;
+
+    if (to->size < from->n)
+    {
+        c = realloc(to->cell, from->n * sizeof(int));
+        if (c == NULL)
+            return -1;
+        to->cell = c;
+        to->size = from->n;
+    }
+    if (from->n)
+        memcpy(to->cell, from->cell, from->n * sizeof(int));
+    to->n = from->n;
+    to->lost = from->lost;
+    return 0;
+}
+
+
+void FreeStart(struct world *w)
+{
+    struct board_copy *s = &w->start;
+
+    free(s->chunk);
+    free(s->awake);
+    free(s->awake_rows);
+    s->chunk = NULL;
+    s->awake = s->awake_rows = NULL;
+    s->level = -1;
+}
+
+
+/********************************************
+ * Keep the board just loaded for a restart *
+ ********************************************/
+void SaveStart(struct world *w, int level)
+{
+    struct board_copy *s = &w->start;
+    size_t chunks = (size_t)w->chunks_x * w->chunks_y * sizeof(struct chunk);
+    size_t awake = (size_t)w->chunks_x * w->height * sizeof(uint64_t);
+    size_t rows = (w->height + 63) / 64 * sizeof(uint64_t);
+    int t;
+
+    FreeStart(w);
+    s->chunk = malloc(chunks);
+    s->awake = malloc(awake);
+    s->awake_rows = malloc(rows);
+    if (s->chunk == NULL || s->awake == NULL || s->awake_rows == NULL)
+    {
+        FreeStart(w); // Restarts will load the level again
+        return;
+    }
+    for (t = 0; t < TILES; t++)
+        if (CopyCells(&s->where[t], &w->where[t]) < 0)
+        {
+            FreeStart(w);
+            return;
+        }
+
+    memcpy(s->chunk, w->chunk, chunks);
+    memcpy(s->awake, w->awake, awake);
+    memcpy(s->awake_rows, w->awake_rows, rows);
+    memcpy(s->count, w->count, sizeof(s->count));
+    s->hash = w->hash;
+    s->level = level;
+}
+
+
+/*****************************************************
+ * Put back the board of the level, as it was loaded *
+ *****************************************************/
+void RestoreStart(struct world *w)
+{
+    struct board_copy *s = &w->start;
+    int t;
+
+    memcpy(w->chunk, s->chunk,
+           (size_t)w->chunks_x * w->chunks_y * sizeof(struct chunk));
+    memcpy(w->awake, s->awake, (size_t)w->chunks_x * w->height * sizeof(uint64_t));
+    memcpy(w->awake_rows, s->awake_rows, (w->height + 63) / 64 * sizeof(uint64_t));
+    memcpy(w->count, s->count, sizeof(w->count));
+    w->hash = s->hash;
+
+    for (t = 0; t < TILES; t++)
+        if (CopyCells(&w->where[t], &s->where[t]) < 0)
+            w->where[t].lost = 1; // The board scans will do
+    w->moved.n = 0;
+    w->moved.lost = 0;
+}
+
+
+/*****************
+ * Loading level *
+ *****************/
+int LoadLevel(struct world *w, int level)
+{
+    const struct level *l;
+    int j, i;
+
+    if (level >= w->levels_count || level < 0)
+        return -1;
+    l = &w->levels[level];
+
+    // Level always starts from a clean board, no state left by the last one
+    if (w->start.level == level && w->width == l->width && w->height == l->height)
+    {
+        RestoreStart(w); // The board of the last level loaded has its size
+    } else
+    {
+        if (ResizeBoard(w, l->width, l->height) < 0)
+            return -1;
+        ResetIndex(w);
+
+        for (j = 0; j <= l->height - 1; j++)
+            for (i = 0; i <= l->width - 1; i++)
+                SetBoard(w, j, i, LevelTile(l, j, i));
+
+        SaveStart(w, level);
+    }
+
+    w->game.level_diamonds = l->diamonds;
+    w->game.level_time = l->time;
+
+    return 0;
+}
+
+
+/**************************************
+ * This function starts the new board *
+ **************************************/
+void StartLevel(struct world *w, int new_level)
+{
+    if (LoadLevel(w, new_level) < 0)
+        if (w->game.current_level != 0)
+        {
+            w->game.current_level = 0;
+            StartLevel(w, w->game.current_level);
+        }
+    w->game.time = w->game.level_time;
+    w->game.move_time = w->game.level_time;
+    w->game.diamonds = w->game.level_diamonds;
+    w->game.hero_state = FACE1;
+    w->death = DEATH_NONE;
+    w->dirty = WORLD_DIRTY_ALL;
+}
+
+
+/****************************
+ * Set the sound to be play *
+ ****************************/
+void SoundRequest(struct world *w, int sound)
+{
+    w->game.sound_to_play = sound;
+}
+
+
+/**********************************************
+ * Make the crash, the player in it is killed *
+ * by the cause (enum death)                  *
+ **********************************************/
+void MakeCrash(struct world *w, int object, int y, int x, int cause)
+{
+    int j, i;
+
+    for (j = y - 1; j <= y + 1; j++)
+        for (i = x - 1; i <= x + 1; i++)
+        {
+            if (GetBoard(w, j, i) == HERO && w->death == DEATH_NONE)
+                w->death = cause;
+            if (GetBoard(w, j, i) != METAL)
+                SetBoard(w, j, i, object);
+        }
+
+    SoundRequest(w, SOUND_EXPLOSION);
+}
+
+
+/********************
+ * Remove the crash *
+ ********************/
+void CrashRemove(struct world *w)
+{
+    struct cell_list *l = &w->where[CRASH];
+    int j, i, k;
+
+    if (w->count[CRASH] == 0)
+        return;
+
+    if (!l->lost)
+    {
+        for (k = 0; k < l->n; k++)
+        {
+            j = l->cell[k] / w->width;
+            i = l->cell[k] % w->width;
+            if (j > 0 && j < w->height - 1 && GetBoard(w, j, i) == CRASH)
+                SetBoard(w, j, i, TUNNEL);
+        }
+        return;
+    }
+
+    for (j = w->height - 2; j > 0; j--)
+        for (i = 0; i <= w->width - 1; i++)
+            if (GetBoard(w, j, i) == CRASH)
+                SetBoard(w, j, i, TUNNEL);
+}
+
+
+/***************************************************
+ * This function control each other box and fly AI *
+ ***************************************************/
+int MoveBox(struct world *w, int j, int i, int d)
+{
+    int dj = j, di = i;
+
+    if (d > WEST)
+        d -= (WEST + 1);
+    if (d < NORTH)
+        d = WEST;
+
+    switch (d)
+    {
+        case NORTH: dj -= 1; break;
+        case EAST:  di += 1; break;
+        case SOUTH: dj += 1; break;
+        case WEST:  di -= 1; break;
+    }
+
+    if (GetBoard(w, dj, di) == HERO)
+    {
+        if (GetBoard(w, j, i) == BOX)
+            MakeCrash(w, CRASH, dj, di, DEATH_BOX);
+        else
+            MakeCrash(w, DIAMOND, dj, di, DEATH_FLY);
+        return 1;
+    }
+
+    if (GetBoard(w, dj, di) == TUNNEL)
+    {
+        if (GetBoard(w, j, i) == BOX)
+            SetBoard(w, dj, di, BOX);
+        else
+            SetBoard(w, dj, di, FLY);
+        SetBoard(w, j, i, TUNNEL);
+        SetBoxMove(w, dj, di, MOVING);
+        SetBoxDir(w, dj, di, d);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**********************************************
+ * This function control boxs's and flys's AI *
+ **********************************************/
+void MoveBoxes(struct world *w)
+{
+    struct cell_list *o = &w->order;
+    int j, i, d, k, t;
+
+    if (w->moved.lost || w->where[BOX].lost || w->where[FLY].lost)
+    {
+        // Lists can't be trusted, go through the whole board
+        for (j = w->height - 2; j > 0; j--)
+            for (i = 1; i < w->width - 1; i++)
+                SetBoxMove(w, j, i, STILL);
+
+        for (j = w->height - 2; j > 0; j--)
+            for (i = 1; i < w->width - 1; i++)
+                if ((GetBoard(w, j, i) == BOX || GetBoard(w, j, i) == FLY)
+                    && GetBoxMove(w, j, i) == STILL)
+                {
+                    for (d = GetBoxDir(w, j, i) - 1; d <= GetBoxDir(w, j, i) + 2; d++)
+                        if (MoveBox(w, j, i, d))
+                            break;
+                }
+
+        w->moved.n = 0;
+        w->moved.lost = 0;
+        return;
+    }
+
+    // Whatever moved the last time is still now
+    for (k = 0; k < w->moved.n; k++)
+    {
+        j = w->moved.cell[k] / w->width;
+        i = w->moved.cell[k] % w->width;
+        if (j > 0 && j < w->height - 1 && i > 0 && i < w->width - 1)
+            SetBoxMove(w, j, i, STILL);
+    }
+    w->moved.n = 0;
+
+    // Boxes and flies in the order the board was scanned in: bottom up,
+    // left to right, so the rows are counted from the bottom for the sort
+    o->n = 0;
+    for (t = BOX; t <= FLY; t += FLY - BOX)
+    {
+        CompactCells(w, t);
+        for (k = 0; k < w->where[t].n; k++)
+        {
+            j = w->where[t].cell[k] / w->width;
+            i = w->where[t].cell[k] % w->width;
+            if (j > 0 && j < w->height - 1 && i > 0 && i < w->width - 1)
+                PushCell(o, (w->height - 1 - j) * w->width + i);
+        }
+    }
+    if (o->lost)
+    {
+        o->lost = 0;
+        w->moved.lost = 1; // Go the long way this time
+        MoveBoxes(w);
+        return;
+    }
+    qsort(o->cell, o->n, sizeof(int), CompareCells);
+
+    for (k = 0; k < o->n; k++)
+    {
+        j = w->height - 1 - o->cell[k] / w->width;
+        i = o->cell[k] % w->width;
+        if ((GetBoard(w, j, i) == BOX || GetBoard(w, j, i) == FLY)
+            && GetBoxMove(w, j, i) == STILL)
+        {
+            for (d = GetBoxDir(w, j, i) - 1; d <= GetBoxDir(w, j, i) + 2; d++)
+                if (MoveBox(w, j, i, d))
+                    break;
+        }
+    }
+}
+
+
+/**********************************************
+ * Rock or diamond can fall on the given side *
+ **********************************************/
+int CanFallOnSide(struct world *w, int j, int i, int side)
+{
+    return GetBoard(w, j, i + side) == TUNNEL
+        && GetBoard(w, j + 1, i + side) == TUNNEL;
+}
+
+
+/*******************************************
+ * Falling rock and diamonds on given side *
+ *******************************************/
+void FallingOnSide(struct world *w, int j, int i, int side)
+{
+    if (CanFallOnSide(w, j, i, side))
+    {
+        SetBoard(w, j, i + side, GetBoard(w, j, i));
+        SetBoard(w, j, i, TUNNEL);
+        SetRockMove(w, j, i + side, MOVING);
+    }
+}
+
+
+/*************************************************
+ * Rocks and diamonds roll down from these tiles *
+ *************************************************/
+int IsSupport(int tile)
+{
+    return tile == ROCK || tile == DIAMOND || tile == WALL
+        || tile == DOOR || tile == METAL;
+}
+
+
+/***************************************************************
+ * Rocks and diamonds of the row which fall, roll, kill or are *
+ * still moving now; bits of the word k of the row h           *
+ ***************************************************************/
+uint64_t RockCandidates(struct world *w, int h, int k)
+{
+    struct chunk *a = ChunkOf(w, h, k), *b = ChunkOf(w, h + 1, k);
+    int r = h & CHUNK_MASK, s = (h + 1) & CHUNK_MASK;
+    uint64_t free, right, left;
+
+    // Cells to roll over: empty, with empty space below. The chunks of
+    // the words aside are the next ones in the chunk row.
+    free = a->plane[PLANE_TUNNEL][r] & b->plane[PLANE_TUNNEL][s];
+    right = free >> 1;
+    left = free << 1;
+    if (k + 1 < w->chunks_x)
+        right |= (a[1].plane[PLANE_TUNNEL][r] & b[1].plane[PLANE_TUNNEL][s]) << 63;
+    if (k > 0)
+        left |= (a[-1].plane[PLANE_TUNNEL][r] & b[-1].plane[PLANE_TUNNEL][s]) >> 63;
+
+    return a->plane[PLANE_ROCK][r]
+        & (b->plane[PLANE_TUNNEL][s]
+           | b->plane[PLANE_ENEMY][s]
+           | a->plane[PLANE_MOVING][r]
+           | (b->plane[PLANE_SUPPORT][s] & (right | left)));
+}
+
+
+/**************************************************
+ * Cells of the word k the rock step goes through *
+ **************************************************/
+uint64_t InsideRow(struct world *w, int k)
+{
+    int n = w->width - 1 - k * 64; // Cells left of the right border
+    uint64_t m = (k == 0) ? ~1ULL : ~0ULL;
+
+    if (n <= 0)
+        return 0;
+    if (n < 64)
+        m &= (1ULL << n) - 1;
+    return m;
+}
+
+
+/**********************************************************
+ * Next random number of the world (xorshift64*), 32 bits *
+ **********************************************************/
+uint32_t Random(struct world *w)
+{
+    uint64_t x = w->random;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    w->random = x;
+    return (x * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+
+/*****************************************************
+ * This function control one rock or diamond falling *
+ *****************************************************/
+void MoveRock(struct world *w, int j, int i)
+{
+    if (GetBoard(w, j, i) == ROCK || GetBoard(w, j, i) == DIAMOND)
+    {
+        // Falling rock or diamond on right or left, when there is a way
+        if (IsSupport(GetBoard(w, j + 1, i))
+            && (CanFallOnSide(w, j, i, FALL_RIGHT)
+                || CanFallOnSide(w, j, i, FALL_LEFT)))
+        {
+            if (Random(w) & 1)
+                FallingOnSide(w, j, i, FALL_RIGHT);
+            else
+                FallingOnSide(w, j, i, FALL_LEFT);
+        }
+
+        // Falling down
+        if (GetBoard(w, j + 1, i) == TUNNEL)
+        {
+            SetBoard(w, j + 1, i, GetBoard(w, j, i));
+            SetBoard(w, j, i, TUNNEL);
+            SetRockMove(w, j + 1, i, MOVING);
+        }
+
+        // Rock or diamond kills the player
+        if (GetBoard(w, j + 1, i) == HERO && GetRockMove(w, j, i) == MOVING)
+            MakeCrash(w, CRASH, j + 1, i, DEATH_ROCK);
+
+        // Rock or diamond kills the BOX
+        if (GetBoard(w, j + 1, i) == BOX)
+            MakeCrash(w, CRASH, j + 1, i, DEATH_ROCK);
+        if (GetBoard(w, j + 1, i) == FLY)
+            MakeCrash(w, DIAMOND, j + 1, i, DEATH_ROCK);
+
+        SetRockMove(w, j, i, STILL);
+    }
+}
+
+
+/**************************************************************
+ * Cell bytes around the word k of row h, as the kernels want *
+ **************************************************************/
+void RowWindow(struct world *w, int h, int k, unsigned char *win)
+{
+    int x = k * 64, n = w->width - x; // Cells of the word on the board
+
+    memset(win, METAL, KERNEL_WINDOW); // Outside of the board
+    memcpy(win + 1, ChunkOf(w, h, k)->mem[h & CHUNK_MASK], n < 64 ? n : 64);
+    if (k > 0)
+        win[0] = *Cell(w, h, x - 1);
+    if (n > 64)
+        win[65] = *Cell(w, h, x + 64);
+}
+
+
+/*****************************************************
+ * Rock candidates from the kernel the world runs on *
+ *****************************************************/
+uint64_t Candidates(struct world *w, int h, int k)
+{
+    unsigned char a[KERNEL_WINDOW], b[KERNEL_WINDOW];
+    uint64_t c, ref;
+
+    if (w->kernel == KERNEL_PLANES && !w->verify)
+        return RockCandidates(w, h, k);
+
+    RowWindow(w, h, k, a);
+    RowWindow(w, h + 1, k, b);
+    if (w->kernel == KERNEL_PLANES)
+        c = RockCandidates(w, h, k);
+    else
+        c = RockKernel(w->kernel, a, b);
+
+    if (w->verify)
+    {
+        ref = RockKernelScalar(a, b);
+        if (c != ref)
+        {
+            fprintf(stderr, "%s rock kernel differs at row %d word %d: "
+                "%016llx, scalar %016llx\n", KernelNames[w->kernel], h, k,
+                (unsigned long long)c, (unsigned long long)ref);
+            abort();
+        }
+    }
+    return c;
+}
+
+
+/***********************************************************
+ * The lowest row from h up with anything awake, 0 if none *
+ ***********************************************************/
+int NextAwakeRow(struct world *w, int h)
+{
+    uint64_t m;
+    int k;
+
+    if (h <= 0)
+        return 0;
+
+    k = h / 64;
+    m = w->awake_rows[k] & (~0ULL >> (63 - h % 64));
+    while (!m)
+    {
+        if (k == 0)
+            return 0;
+        m = w->awake_rows[--k];
+    }
+    return k * 64 + 63 - __builtin_clzll(m);
+}
+
+
+/***************************************************
+ * This function control rock and diamonds falling *
+ ***************************************************/
+void MoveRocks(struct world *w)
+{
+    int j, k, i;
+    uint64_t *awake, c, ahead, any;
+
+    // Rows in the order the whole board was scanned in, every other one
+    // from right to left, skipping the rows and words with nothing awake.
+    // Candidates are taken again after every move, so a rock rolling into
+    // the cells ahead moves again like before (it is woken up on the way).
+    for (j = NextAwakeRow(w, w->height - 2); j > 0; j = NextAwakeRow(w, j - 1))
+    {
+        awake = &w->awake[j * w->chunks_x];
+
+        if (j % 2)
+        {
+            for (k = w->chunks_x - 1; k >= 0; k--)
+                for (ahead = InsideRow(w, k);
+                     awake[k] && (c = Candidates(w, j, k) & ahead) != 0; )
+                {
+                    i = 63 - __builtin_clzll(c);
+                    ahead &= (1ULL << i) - 1;
+                    MoveRock(w, j, k * 64 + i);
+                }
+        } else
+        {
+            for (k = 0; k < w->chunks_x; k++)
+                for (ahead = InsideRow(w, k);
+                     awake[k] && (c = Candidates(w, j, k) & ahead) != 0; )
+                {
+                    i = __builtin_ctzll(c);
+                    ahead &= (i < 63) ? ~0ULL << (i + 1) : 0;
+                    MoveRock(w, j, k * 64 + i);
+                }
+        }
+
+        // Rocks and diamonds which settled down sleep till woken up
+        for (k = 0, any = 0; k < w->chunks_x; k++)
+            if (awake[k])
+            {
+                awake[k] &= Candidates(w, j, k);
+                any |= awake[k];
+            }
+        if (!any)
+            w->awake_rows[j / 64] &= ~(1ULL << (j % 64));
+    }
+}
+
+
+/**********************************
+ * This function finds the object *
+ **********************************/
+int FindObject(struct world *w, int object, int *y, int *x)
+{
+    struct cell_list *l = &w->where[object];
+    int j, i, k, c, found = -1;
+
+    if (w->count[object] == 0)
+        return (-1); // Object not found
+
+    if ((INDEXED_TILES & (1 << object)) && !l->lost)
+    {
+        // The first one in the board order, like the scan below
+        for (k = 0; k < l->n; k++)
+        {
+            c = l->cell[k];
+            j = c / w->width;
+            i = c % w->width;
+            if ((found < 0 || c < found)
+                && j > 0 && j < w->height - 1 && i > 0 && i < w->width - 1
+                && GetBoard(w, j, i) == object)
+                found = c;
+        }
+        if (found < 0)
+            return (-1);
+        if (y != 0)
+            *y = found / w->width;
+        if (x != 0)
+            *x = found % w->width;
+        return object;
+    }
+
+    for (j = 1; j < w->height - 1; j++)
+        for (i = 1; i < w->width - 1; i++)
+            if (GetBoard(w, j, i) == object)
+            {
+                if (y != 0)
+                    *y = j;
+                if (x != 0)
+                    *x = i;
+                return object; // Object found
+            }
+    return (-1); // Object not found
+}
+
+
+/**********************************
+ * This function moves the player *
+ **********************************/
+void MoveHero(struct world *w, int y, int x)
+{
+    int j, i, o;
+
+    if (FindObject(w, HERO, &j, &i) != HERO)
+        return;
+
+    o = GetBoard(w, j + y, i + x);
+
+    switch (o)
+    {
+        case DIAMOND: // Get the diamond
+            if (w->game.diamonds)
+                w->game.diamonds--;
+            w->dirty |= WORLD_DIRTY_STATUS;
+            SoundRequest(w, SOUND_DIAMOND);
+            break;
+        case ROCK: // Push the rock
+            if (x > 0)
+                if (GetBoard(w, j, i + x + 1) == TUNNEL)
+                {
+                    SetBoard(w, j, i + x, TUNNEL);
+                    SetBoard(w, j, i + x + 1, ROCK);
+                }
+            if (x < 0)
+                if (GetBoard(w, j, i + x - 1) == TUNNEL)
+                {
+                    SetBoard(w, j, i + x, TUNNEL);
+                    SetBoard(w, j, i + x - 1, ROCK);
+                }
+            o = GetBoard(w, j + y, i + x);
+            break;
+        case BOX:
+            MakeCrash(w, CRASH, j + y, i + x, DEATH_BOX);
+            return;
+        case FLY:
+            MakeCrash(w, DIAMOND, j + y, i + x, DEATH_FLY);
+            return;
+    }
+
+    // Move player if it's possible
+    if (o != WALL && o != ROCK && o != METAL
+         && j + y >= 0 && i + x >= 0
+         && j + y < w->height && i + x < w->width
+         && (o != DOOR || !w->game.diamonds))
+    {
+        if (w->game.move_mode == REAL)
+        {
+            SetBoard(w, j, i, TUNNEL);
+            SetBoard(w, j + y, i + x, HERO);
+        } else
+        {
+            SetBoard(w, j + y, i + x, TUNNEL);
+        }
+        if (w->game.sound_to_play == SOUND_NONE)
+            SoundRequest(w, SOUND_MOVE);
+    }
+
+    w->game.move_mode = REAL;
+    w->game.move_time = w->game.time;
+    return;
+}
+
+
+/***************
+ * Kill player *
+ ***************/
+void KillHero(struct world *w, int cause)
+{
+    int y, x;
+
+    if (FindObject(w, HERO, &y, &x) == HERO)
+        MakeCrash(w, CRASH, y, x, cause);
+}
+
+
+/*****************************************************
+ * Remember the player position (followed by camera) *
+ *****************************************************/
+void TrackHero(struct world *w)
+{
+    int y, x;
+
+    if (FindObject(w, HERO, &y, &x) < 0)
+    {
+        w->game.hero_state = KILLED;
+    } else if (x != w->game.lastposx || y != w->game.lastposy)
+    {
+        w->game.lastposx = x;
+        w->game.lastposy = y;
+        w->dirty |= WORLD_DIRTY_VIEW;
+    }
+}
+
+
+/**************************************
+ * End of the time and level checking *
+ **************************************/
+int CheckStatus(struct world *w)
+{
+    if (!w->game.time)
+    {
+        KillHero(w, DEATH_TIME);
+        return WORLD_GAME_OVER;
+    }
+    if (!w->game.diamonds && FindObject(w, DOOR, 0, 0) < 0)
+    {
+        StartLevel(w, ++w->game.current_level);
+        return WORLD_LEVEL_DONE;
+    }
+    return 0;
+}
+
+
+/*********************
+ * Time decrementing *
+ *********************/
+void DecrementTime(struct world *w)
+{
+    if (w->game.time <= 0 || w->game.hero_state == KILLED)
+        return;
+
+    switch (w->time_timer--)
+    {
+        case 0:
+            w->game.time--;
+            w->time_timer = INTER_TIME;
+            w->dirty |= WORLD_DIRTY_STATUS;
+        case INTER_TIME / 2:
+            if (w->game.hero_state == FACE1
+                && w->game.move_time - w->game.time > 5)
+                w->game.hero_state = FACE2;
+            else
+                w->game.hero_state = FACE1;
+    }
+}
+
+
+/****************************************************************
+ * Ticks from now until world_step() may change anything but    *
+ * its clocks: 1 while anything can move, else up to the next   *
+ * second off the time, or WORLD_QUIET_MAX when the time stands *
+ * (the player is dead). A key may end the quiet any time       *
+ ****************************************************************/
+int world_quiet(struct world *w)
+{
+    int k;
+
+    if (w->count[CRASH] || w->count[BOX] || w->count[FLY])
+        return 1;
+    for (k = 0; k < (w->height + 63) / 64; k++)
+        if (w->awake_rows[k])
+            return 1; // Rocks to look at, if not to move
+
+    if (w->game.hero_state == KILLED)
+        return WORLD_QUIET_MAX;
+    if (w->game.time <= 0 || (!w->game.diamonds && FindObject(w, DOOR, 0, 0) < 0))
+        return 1; // CheckStatus() is about to end it
+    return w->time_timer + 1 < WORLD_QUIET_MAX ? w->time_timer + 1 : WORLD_QUIET_MAX;
+}
+
+
+/*******************************************
+ * Handle a key press, returns 1 on a move *
+ *******************************************/
+int world_key(struct world *w, int key)
+{
+    switch (key)
+    {
+        case 'a':
+        case KEY_LEFT:
+            MoveHero(w, 0, -1);
+            w->game.hero_state = LEFT;
+            break;
+        case 'd':
+        case KEY_RIGHT:
+            MoveHero(w, 0, 1);
+            w->game.hero_state = RIGHT;
+            break;
+        case 'w':
+        case KEY_UP:
+            MoveHero(w, -1, 0);
+            break;
+        case 's':
+        case KEY_DOWN:
+            MoveHero(w, 1, 0);
+            break;
+        case 32: case 13: // Spacebar, Return
+            if (w->game.hero_state == KILLED)
+                StartLevel(w, w->game.current_level);
+            else
+                w->game.move_mode = GHOST;
+            return 0;
+        case 'm':
+            w->game.sound_mode ^= 1;
+            w->dirty |= WORLD_DIRTY_STATUS;
+            return 0;
+        case 'n':
+            StartLevel(w, ++w->game.current_level);
+            return 0;
+        case 'p':
+            if (w->game.current_level > 0)
+                StartLevel(w, --w->game.current_level);
+            return 0;
+        case 'r':
+            KillHero(w, DEATH_KEY);
+            return 0;
+        case 'j': // Respawn cheat
+            SetBoard(w, w->game.lastposy, w->game.lastposx, HERO);
+            w->game.hero_state = FACE1;
+            w->death = DEATH_NONE;
+            return 0;
+        case 't': // Time cheat
+            w->game.time = w->game.level_time;
+            w->dirty |= WORLD_DIRTY_STATUS;
+            return 0;
+        default:
+            return 0;
+    }
+
+    TrackHero(w);
+    return 1;
+}
+
+
+/**********************************************
+ * Bytes of the snapshot of the current level *
+ **********************************************/
+size_t world_snapshot_size(struct world *w)
+{
+    return sizeof(struct snapshot) + (size_t)w->width * w->height;
+}
+
+
+void SnapshotHead(struct world *w, struct snapshot *s)
+{
+    memset(s, 0, sizeof(struct snapshot)); // Padding too, snapshots are compared
+    s->game = w->game;
+    s->refresh_timer = w->refresh_timer;
+    s->time_timer = w->time_timer;
+    s->random = w->random;
+    s->width = w->width;
+    s->height = w->height;
+}
+
+
+/***************************************************
+ * Copy the state of the world, no allocation made *
+ ***************************************************/
+void world_snapshot(struct world *w, struct snapshot *s)
+{
+    unsigned char *cell = s->cells;
+    int j, x, n;
+
+    SnapshotHead(w, s);
+    for (j = 0; j < w->height; j++)
+        for (x = 0; x < w->width; x += CHUNK_SIZE)
+        {
+            n = (w->width - x < CHUNK_SIZE) ? w->width - x : CHUNK_SIZE;
+            memcpy(cell, Cell(w, j, x), n);
+            cell += n;
+        }
+}
+
+
+/**********************************************************
+ * The hash of the cells made again from all of them, for *
+ * checking the one kept by the writes                    *
+ **********************************************************/
+uint64_t HashBoard(struct world *w)
+{
+    uint64_t h = 0;
+    int j, i;
+
+    for (j = 0; j < w->height; j++)
+        for (i = 0; i < w->width; i++)
+            h ^= CellKey(j, i, *Cell(w, j, i));
+    return h;
+}
+
+
+/*******************************************************
+ * The digest of the world, see struct world_digest; a *
+ * few loads, cheap enough for every tick              *
+ *******************************************************/
+struct world_digest world_digest(struct world *w)
+{
+    struct world_digest d;
+
+    d.hash = w->hash;
+    d.diamonds = w->game.diamonds;
+    d.time = w->game.time;
+    return d;
+}
+
+
+/***********************************************************
+ * FNV-1a of the snapshot, without making it; equal worlds *
+ * have equal sums                                         *
+ ***********************************************************/
+uint64_t world_checksum(struct world *w)
+{
+    struct snapshot head;
+    const unsigned char *p;
+    uint64_t h = 14695981039346656037ULL;
+    int j, x, n;
+
+    SnapshotHead(w, &head);
+    for (p = (const unsigned char*)&head; p < (const unsigned char*)(&head + 1); p++)
+        h = (h ^ *p) * 1099511628211ULL;
+
+    for (j = 0; j < w->height; j++)
+        for (x = 0; x < w->width; x += CHUNK_SIZE)
+        {
+            n = (w->width - x < CHUNK_SIZE) ? w->width - x : CHUNK_SIZE;
+            for (p = Cell(w, j, x); n--; p++)
+                h = (h ^ *p) * 1099511628211ULL;
+        }
+    return h;
+}
+
+
+/*******************************************************************
+ * Put the world back as it was at the snapshot, -1 when the board *
+ * can't be had. Counts, lists and bitplanes are made again.       *
+ *******************************************************************/
+int world_restore(struct world *w, const struct snapshot *s)
+{
+    const unsigned char *cell = s->cells;
+    int j, i, t;
+
+    if (s->width < 3 || s->height < 3 || s->width > LEVEL_MAX
+        || s->height > LEVEL_MAX || ResizeBoard(w, s->width, s->height) < 0)
+        return -1;
+    ResetIndex(w);
+
+    for (j = 0; j < w->height; j++)
+        for (i = 0; i < w->width; i++, cell++)
+        {
+            t = *cell & CELL_TILE;
+            SetBoard(w, j, i, t <= CRASH ? t : METAL);
+            if (*cell & CELL_ROCK_MOVE)
+                SetRockMove(w, j, i, MOVING);
+            if (*cell & CELL_BOX_MOVE)
+                SetBoxMove(w, j, i, MOVING);
+            SetBoxDir(w, j, i, (*cell & CELL_BOX_DIR) >> CELL_BOX_DIR_SHIFT);
+        }
+
+    w->game = s->game;
+    w->refresh_timer = s->refresh_timer;
+    w->time_timer = s->time_timer;
+    w->random = s->random ? s->random : 1;
+    w->death = DEATH_NONE; // Not in the snapshot, a dead player's cause is lost
+    w->dirty = WORLD_DIRTY_ALL;
+    return 0;
+}
+
+
+/***************************************************************
+ * Make the world the same as the other one, -1 when the board *
+ * can't be had; for searches trying moves from one state      *
+ ***************************************************************/
+int world_copy(struct world *to, struct world *from)
+{
+    int t;
+
+    if (ResizeBoard(to, from->width, from->height) < 0)
+        return -1;
+
+    memcpy(to->chunk, from->chunk,
+           (size_t)from->chunks_x * from->chunks_y * sizeof(struct chunk));
+    memcpy(to->awake, from->awake,
+           (size_t)from->chunks_x * from->height * sizeof(uint64_t));
+    memcpy(to->awake_rows, from->awake_rows,
+           (from->height + 63) / 64 * sizeof(uint64_t));
+    memcpy(to->count, from->count, sizeof(to->count));
+
+    for (t = 0; t < TILES; t++)
+        if (CopyCells(&to->where[t], &from->where[t]) < 0)
+            to->where[t].lost = 1; // The board scans will do
+    if (CopyCells(&to->moved, &from->moved) < 0)
+        to->moved.lost = 1;
+
+    to->levels = from->levels;
+    to->levels_count = from->levels_count;
+    to->kernel = from->kernel;
+    to->verify = from->verify;
+    to->game = from->game;
+    to->refresh_timer = from->refresh_timer;
+    to->time_timer = from->time_timer;
+    to->random = from->random;
+    to->death = from->death;
+    to->hash = from->hash;
+    to->dirty = WORLD_DIRTY_ALL;
+    return 0;
+}
+
+
+void world_destroy(struct world *w)
+{
+    int t;
+
+    for (t = 0; t < TILES; t++)
+        free(w->where[t].cell);
+    free(w->moved.cell);
+    free(w->order.cell);
+    free(w->chunk);
+    free(w->awake);
+    free(w->awake_rows);
+    if (w->twin != NULL)
+        world_destroy(w->twin);
+    FreeStart(w);
+    for (t = 0; t < TILES; t++)
+        free(w->start.where[t].cell);
+    free(w);
+}
+
+
+/*******************************************************************
+ * Seed the random generator of the world. The same seed and the   *
+ * same keys give the same game, whatever else runs in the process *
+ *******************************************************************/
+void world_seed(struct world *w, uint64_t seed)
+{
+    // Spread the seed over all the bits (splitmix64)
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    seed ^= seed >> 31;
+    w->random = seed ? seed : 1; // xorshift never leaves 0
+}
+
+
+/**********************************
+ * The levels built in (levels.h) *
+ **********************************/
+const struct level *BuiltinLevels(void)
+{
+    static struct level l[LEVELS_NUMBERS];
+    int n;
+
+    for (n = 0; n < LEVELS_NUMBERS; n++)
+    {
+        l[n].width = LEVELS_WIDTH;
+        l[n].height = LEVELS_HIGH;
+        l[n].diamonds = levels_diamonds[n];
+        l[n].time = levels_time[n];
+        l[n].cells = levels[n][0];
+        l[n].stride = LEVELS_WIDTH + 1;
+    }
+    return l;
+}
+
+
+/********************************************************************
+ * Read the levels from a text file. Every level is a line with the *
+ * diamonds and the time, then the rows of tiles ('0' + tile) like  *
+ * in levels.h, one a line; levels are parted by empty lines.       *
+ ********************************************************************/
+struct level *world_read_levels(const char *path, int *count)
+{
+    FILE *f = fopen(path, "r");
+    struct level *l = NULL, *more;
+    char *text = NULL, *p;
+    long size = -1;
+    int n = 0, width, height, i;
+
+    if (f == NULL)
+        return NULL;
+    if (!fseek(f, 0, SEEK_END) && (size = ftell(f)) >= 0 && !fseek(f, 0, SEEK_SET))
+        text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, f) != (size_t)size)
+        goto fail;
+    fclose(f);
+    f = NULL;
+    text[size] = 0; // The levels point into the text, it is kept
+
+    for (p = text; *p; )
+    {
+        if (*p == '\n')
+        {
+            p++;
+            continue;
+        }
+
+        more = realloc(l, (n + 1) * sizeof(struct level));
+        if (more == NULL)
+            goto fail;
+        l = more;
+        if (sscanf(p, "%d %d", &l[n].diamonds, &l[n].time) != 2
+            || (p = strchr(p, '\n')) == NULL)
+            goto fail;
+
+        l[n].cells = ++p;
+        width = strcspn(p, "\n");
+        for (height = 0; *p && *p != '\n'; height++)
+        {
+            if ((int)strcspn(p, "\n") != width)
+                goto fail;
+            for (i = 0; i < width; i++)
+                if (p[i] < '0' || p[i] > '0' + CRASH)
+                    goto fail;
+            p += width;
+            if (*p)
+                p++;
+        }
+        if (width < 3 || height < 3 || width > LEVEL_MAX || height > LEVEL_MAX)
+            goto fail;
+
+        l[n].width = width;
+        l[n].height = height;
+        l[n].stride = width + 1;
+        l[n].packed = NULL;
+        n++;
+    }
+    if (n == 0)
+        goto fail;
+
+    *count = n;
+    return l;
+
+fail:
+    if (f != NULL)
+        fclose(f);
+    free(text);
+    free(l);
+    return NULL;
+}
+
+
+/**************************************************
+ * Create the world on the given level of the set *
+ **************************************************/
+struct world *world_create_levels(const struct level *levels, int count,
+                                  int level)
+{
+    struct world *w = calloc(1, sizeof(struct world));
+
+    if (w == NULL)
+        return NULL;
+
+    w->levels = levels;
+    w->levels_count = count;
+    w->start.level = -1;
+    world_seed(w, WORLD_SEED);
+    w->game.current_level = level;
+    w->game.diamonds      = 0;
+    w->game.move_mode     = REAL;
+    w->game.sound_mode    = 1;
+    w->game.sound_to_play = SOUND_NONE;
+
+    w->refresh_timer = 0;
+    w->time_timer    = INTER_TIME;
+    w->kernel        = KernelSupported(KERNEL_AUTO);
+
+    StartLevel(w, w->game.current_level);
+    if (w->chunk == NULL)
+    {
+        // Not even the first level fits in memory
+        world_destroy(w);
+        return NULL;
+    }
+    return w;
+}
+
+
+/***************************************************
+ * Create the world on the given level of built in *
+ ***************************************************/
+struct world *world_create(int level)
+{
+    return world_create_levels(BuiltinLevels(), LEVELS_NUMBERS, level);
+}
+
+
+/***************************************************
+ * Rock kernel by name, -1 if unknown or can't run *
+ ***************************************************/
+int world_kernel(const char *name)
+{
+    int k;
+
+    for (k = 0; k < KERNELS; k++)
+        if (!strcmp(name, KernelNames[k]))
+            return KernelSupported(k);
+    return -1;
+}
+
+
+/******************************************************
+ * Add the time since "from" to the phase, when the   *
+ * phases are timed; returns the time now, 0 when not *
+ ******************************************************/
+uint64_t PhaseClock(struct world *w, int phase, uint64_t from)
+{
+    struct timespec t;
+    uint64_t now;
+
+    if (w->phase_ns == NULL)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    now = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+    if (phase < PHASES)
+        w->phase_ns[phase] += now - from;
+    return now;
+}
+
+
+// One tick, see world_step()
+int StepWorld(struct world *w)
+{
+    uint64_t t;
+    int events = 0;
+
+    DecrementTime(w);
+
+    if (!w->refresh_timer--)
+    {
+        t = PhaseClock(w, PHASES, 0);
+        CrashRemove(w);
+        t = PhaseClock(w, PHASE_CRASH, t);
+        MoveRocks(w);
+        t = PhaseClock(w, PHASE_ROCKS, t);
+        MoveBoxes(w);
+        PhaseClock(w, PHASE_BOXES, t);
+        events = CheckStatus(w) | WORLD_REFRESH;
+        TrackHero(w);
+        w->refresh_timer = INTER_TIME / 5; // The speed of moving objects
+
+        if (w->verify && w->hash != HashBoard(w))
+        {
+            fprintf(stderr, "board hash differs: %016llx kept, %016llx "
+                "from the cells\n", (unsigned long long)w->hash,
+                (unsigned long long)HashBoard(w));
+            abort();
+        }
+    }
+
+    return events;
+}
+
+
+/*****************************************************************
+ * Step the world and a copy of it made with the scalar kernel,  *
+ * abort when the two boards come out different                  *
+ *****************************************************************/
+int VerifyStep(struct world *w)
+{
+    struct world *twin = w->twin;
+    int events, twin_events, j, i;
+
+    if (twin == NULL)
+        twin = w->twin = world_create_levels(w->levels, w->levels_count,
+                                             w->game.current_level);
+    if (twin == NULL || world_copy(twin, w) < 0)
+    {
+        fprintf(stderr, "no memory for the scalar twin of the world\n");
+        abort();
+    }
+    twin->kernel = KERNEL_SCALAR;
+    twin->verify = 0;
+
+    events = StepWorld(w);
+    twin_events = StepWorld(twin);
+    if (events == twin_events && world_checksum(w) == world_checksum(twin))
+        return events;
+
+    for (j = 0; j < w->height; j++)
+        for (i = 0; i < w->width; i++)
+            if (*Cell(w, j, i) != *Cell(twin, j, i))
+            {
+                fprintf(stderr, "%s rock kernel board differs at row %d column "
+                    "%d: %02x, scalar %02x\n", KernelNames[w->kernel], j, i,
+                    *Cell(w, j, i), *Cell(twin, j, i));
+                abort();
+            }
+    fprintf(stderr, "%s rock kernel differs from the scalar one: events %x, "
+        "scalar %x\n", KernelNames[w->kernel], events, twin_events);
+    abort();
+}
+
+
+/*************************************************
+ * One tick of the game clock (INTER_TIME a sec) *
+ *************************************************/
+int world_step(struct world *w)
+{
+    return w->verify ? VerifyStep(w) : StepWorld(w);
+}